@@ -0,0 +1,46 @@
+#include "admission-control.h"
+
+#include <cassert>
+
+
+bool AdmissionControl::admit(std::uint32_t address)
+{
+	std::lock_guard<std::mutex> lg(_mutex);
+	
+	if (_connectionsCount >= _maxConnections)
+	{
+		return false;
+	}
+	
+	std::size_t& n = _connectionsPerAddress[address];
+	if (_maxConnectionsPerAddress != 0 && n >= _maxConnectionsPerAddress)
+	{
+		return false;
+	}
+	
+	n += 1;
+	_connectionsCount += 1;
+	return true;
+}
+
+void AdmissionControl::release(std::uint32_t address)
+{
+	std::lock_guard<std::mutex> lg(_mutex);
+	
+	std::unordered_map<std::uint32_t, std::size_t>::iterator it = _connectionsPerAddress.find(address);
+	assert(it != _connectionsPerAddress.end() && it->second != 0);
+	assert(_connectionsCount != 0);
+	
+	if (--it->second == 0)
+	{
+		_connectionsPerAddress.erase(it);
+	}
+	
+	_connectionsCount -= 1;
+}
+
+std::size_t AdmissionControl::connectionsCount() const
+{
+	std::lock_guard<std::mutex> lg(_mutex);
+	return _connectionsCount;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+
+// Counts the connections globally and per source address (IPv4, network
+// byte order). The connection over either limit is not admitted.
+class AdmissionControl final
+{
+public:
+	AdmissionControl(const AdmissionControl&) = delete;
+	AdmissionControl& operator=(const AdmissionControl&) = delete;
+	
+	AdmissionControl() = default;
+	
+	// 0 - no limit per address
+	void setLimits(std::size_t maxConnections, std::size_t maxConnectionsPerAddress)
+	{
+		std::lock_guard<std::mutex> lg(_mutex);
+		_maxConnections = maxConnections;
+		_maxConnectionsPerAddress = maxConnectionsPerAddress;
+	}
+	
+	// return true and count the connection, if it's admitted (thread-safe)
+	bool admit(std::uint32_t address);
+	
+	// the admitted connection is closed (thread-safe)
+	void release(std::uint32_t address);
+	
+	std::size_t connectionsCount() const;
+	
+private:
+	mutable std::mutex _mutex;
+	std::size_t _maxConnections = 0;
+	std::size_t _maxConnectionsPerAddress = 0;
+	std::size_t _connectionsCount = 0;
+	std::unordered_map<std::uint32_t, std::size_t> _connectionsPerAddress;
+};
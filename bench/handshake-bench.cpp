@@ -0,0 +1,194 @@
+// Digest authenticated handshakes per second of MJPEGServer over
+// loopback. Every client gets a nonce once and then repeats the
+// authorized request on new connections (nc is incremented):
+//   handshake-bench [port] [clients] [seconds]
+
+#include "md5-digest.h"
+#include "mjpeg-server.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace
+{
+
+const char* const USERNAME = "bench";
+const char* const PASSWORD = "bench";
+const char* const URI = "/";
+
+int connectTo(unsigned short port)
+{
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock == -1)
+	{
+		perror("socket()");
+		throw std::runtime_error("Could not create socket.");
+	}
+	
+	// reset on close, so the client side doesn't run out of ports in TIME_WAIT
+	struct linger lin = { 1, 0 };
+	setsockopt(sock, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+	
+	struct sockaddr_in addr = { 0 };
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	
+	if (connect(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1)
+	{
+		perror("connect()");
+		close(sock);
+		throw std::runtime_error("Could not connect to the server.");
+	}
+	
+	return sock;
+}
+
+// send the request, return the response headers
+std::string exchange(unsigned short port, const std::string& request)
+{
+	int sock = connectTo(port);
+	
+	std::string response;
+	if (send(sock, request.data(), request.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(request.size()))
+	{
+		char buffer[1024];
+		while (response.find("\r\n\r\n") == std::string::npos)
+		{
+			ssize_t nbytes = recv(sock, buffer, sizeof(buffer), 0);
+			if (nbytes <= 0)
+			{
+				break;
+			}
+			
+			response.append(buffer, nbytes);
+		}
+	}
+	
+	close(sock);
+	return response;
+}
+
+void client(unsigned short port, const std::atomic<bool>& running, 
+		std::atomic<unsigned long>& handshakes, std::atomic<unsigned long>& failures)
+{
+	// get the challenge. the status line parses as method, url and version.
+	const std::string challenge = exchange(port, "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n");
+	
+	HttpRequest response;
+	DigestParams params;
+	StringRef authenticate;
+	if (!response.parse(challenge) || !response.url().equals("401")
+		|| (authenticate = response.header("WWW-Authenticate")).size() < 7
+		|| !params.parse(authenticate.substr(7)))
+	{
+		failures++;
+		return;
+	}
+	
+	const std::string realm = params.get("realm").str();
+	const std::string nonce = params.get("nonce").str();
+	const std::string opaque = params.get("opaque").str();
+	const std::string cnonce = "0a4f113b";
+	
+	MD5Digest md5;
+	const MD5Digest::Hex ha1 = md5.update(USERNAME).update(':').update(realm)
+		.update(':').update(PASSWORD).finish();
+	const MD5Digest::Hex ha2 = md5.update("GET:").update(URI).finish();
+	
+	unsigned long nc = 0;
+	while (running)
+	{
+		char ncHex[9];
+		std::snprintf(ncHex, sizeof(ncHex), "%08lx", ++nc);
+		
+		const MD5Digest::Hex digest = md5.update(ha1).update(':').update(nonce).update(':')
+			.update(ncHex).update(':').update(cnonce).update(":auth:").update(ha2).finish();
+		
+		const std::string request = std::string("GET ") + URI + " HTTP/1.1\r\n"
+			"Host: localhost\r\n"
+			"Authorization: Digest username=\"" + USERNAME + "\", realm=\"" + realm
+				+ "\", nonce=\"" + nonce + "\", uri=\"" + URI + "\", algorithm=MD5, response=\""
+				+ std::string(digest.data(), digest.size()) + "\", opaque=\"" + opaque
+				+ "\", qop=auth, nc=" + ncHex + ", cnonce=\"" + cnonce + "\"\r\n"
+			"\r\n";
+		
+		if (exchange(port, request).compare(0, 12, "HTTP/1.0 200") == 0)
+		{
+			handshakes++;
+		}
+		else
+		{
+			failures++;
+		}
+	}
+}
+
+}
+
+
+int main(int argc, char* argv[])
+{
+	const unsigned short port = argc > 1 ? std::atoi(argv[1]) : 8091;
+	const unsigned clientsCount = argc > 2 ? std::atoi(argv[2]) : 4;
+	const int seconds = argc > 3 ? std::atoi(argv[3]) : 5;
+	
+	// the server logs every request, keep it out of the results
+	std::streambuf* coutBuffer = std::cout.rdbuf(nullptr);
+	
+	try
+	{
+		MJPEGServer server(port);
+		server.setCredentials({ std::string(USERNAME) + ":" + PASSWORD });
+		server.start();
+		
+		std::atomic<bool> running(true);
+		std::atomic<unsigned long> handshakes(0);
+		std::atomic<unsigned long> failures(0);
+		
+		std::vector<std::thread> clients;
+		for (unsigned i = 0; i < clientsCount; i++)
+		{
+			clients.emplace_back(client, port, std::cref(running), 
+				std::ref(handshakes), std::ref(failures));
+		}
+		
+		std::this_thread::sleep_for(std::chrono::seconds(seconds));
+		running = false;
+		
+		for (std::thread& t : clients)
+		{
+			t.join();
+		}
+		
+		server.stop();
+		
+		std::cout.rdbuf(coutBuffer);
+		std::cout.clear();
+		std::cout << clientsCount << " clients: "
+			<< static_cast<double>(handshakes) / seconds << " handshakes/s, "
+			<< failures << " failures" << std::endl;
+	}
+	catch (const std::exception& ex)
+	{
+		std::cout.rdbuf(coutBuffer);
+		std::cout.clear();
+		std::cerr << ex.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	
+	return EXIT_SUCCESS;
+}
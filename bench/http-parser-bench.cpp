@@ -0,0 +1,174 @@
+// Parse time of a typical authorized request: the request line, the
+// Authorization header and its Digest parameters. A condensed copy of
+// the legacy std::string/std::map based parser of MJPEGServer is kept
+// here as the baseline.
+//   http-parser-bench [iterations]
+
+#include "http-request.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+
+
+namespace
+{
+
+const std::string REQUEST = 
+	"GET /stream HTTP/1.1\r\n"
+	"Host: 192.168.1.10:8090\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+	"Accept: image/avif,image/webp,*/*\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate\r\n"
+	"Connection: keep-alive\r\n"
+	"Authorization: Digest username=\"bob\", realm=\"mjpeg server\", "
+		"nonce=\"6f1c2d3e4a5b69788796a5b4c3d2e1f0\", uri=\"/stream\", algorithm=MD5, "
+		"response=\"0c4e1b2f8a6d7e9c3b5a4f2e1d0c9b8a\", opaque=\"5ccc069c403ebaf9f0171e9517f40e41\", "
+		"qop=auth, nc=00000001, cnonce=\"0a4f113b\"\r\n"
+	"\r\n";
+
+std::string legacyGetHeader(const std::string& request, const std::string& headerName)
+{
+	std::string headerValue;
+	
+	std::size_t p = request.find(headerName);
+	if (p != std::string::npos)
+	{
+		p += headerName.length() + 2;
+		std::size_t p1 = request.find("\r\n", p);
+		if (p1 != std::string::npos)
+		{
+			headerValue = request.substr(p, p1 - p);
+		}
+	}
+	
+	return headerValue;
+}
+
+std::pair<std::string, std::string> legacyGetMethodAndUrl(const std::string& request)
+{
+	std::string method;
+	std::string url;
+	
+	std::size_t p = request.find_first_of(' ');
+	if (p != std::string::npos)
+	{
+		method = request.substr(0, p);
+		p += 1;
+		std::size_t p1 = request.find_first_of(' ', p);
+		if (p1 != std::string::npos)
+		{
+			url = request.substr(p, p1 - p);
+		}
+	}
+
+	return {method, url};
+}
+
+std::map<std::string, std::string> legacyParseAuthData(const std::string& data)
+{
+	std::map<std::string, std::string> kvData;
+	
+	std::size_t p0 = 0;
+	while (p0 < data.length())
+	{
+		std::size_t p1 = data.find_first_of(',', p0);
+		if (p1 == std::string::npos)
+		{
+			p1 = data.length();
+		}
+		
+		const std::string s(data.substr(p0, p1 - p0));
+		std::size_t p = s.find_first_of('=');
+		if (p != std::string::npos)
+		{
+			std::string k = s.substr(0, p);
+			std::string v = s.substr(p + 1);
+			while (!v.empty() && v.front() == '\"')
+			{
+				v.erase(0, 1);
+			}
+			while (!v.empty() && v.back() == '\"')
+			{
+				v.pop_back();
+			}
+			kvData.emplace(k, v);
+		}
+		
+		p0 = p1 + 1;
+		while (p0 < data.length() && data[p0] == ' ')
+		{
+			p0++;
+		}
+	}
+	
+	return kvData;
+}
+
+// the volatile sink keeps the compiler from dropping the parsing
+volatile std::size_t sink = 0;
+
+std::size_t legacyParse()
+{
+	const std::string header = legacyGetHeader(REQUEST, "Authorization");
+	const std::pair<std::string, std::string> methodAndUrl = legacyGetMethodAndUrl(REQUEST);
+	const std::size_t p = header.find_first_of(' ');
+	const std::map<std::string, std::string> authData = legacyParseAuthData(header.substr(p + 1));
+	return methodAndUrl.first.size() + authData.at("response").size() + authData.at("uri").size();
+}
+
+std::size_t parse()
+{
+	HttpRequest request;
+	request.parse(REQUEST);
+	const StringRef header = request.header("Authorization");
+	const std::size_t p = header.find(' ');
+	DigestParams authData;
+	authData.parse(header.substr(p + 1));
+	return request.method().size() + authData.get("response").size() + authData.get("uri").size();
+}
+
+template <typename F>
+double nsPerRequest(F f, long iterations)
+{
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (long i = 0; i < iterations; i++)
+	{
+		sink = sink + f();
+	}
+	const std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+	return static_cast<double>(elapsed.count()) / iterations;
+}
+
+}
+
+
+int main(int argc, char* argv[])
+{
+	const long iterations = argc > 1 ? std::atol(argv[1]) : 1000000;
+	
+	if (legacyParse() != parse())
+	{
+		std::cerr << "The parsers disagree." << std::endl;
+		return EXIT_FAILURE;
+	}
+	
+	// warm up
+	nsPerRequest(legacyParse, iterations / 10);
+	nsPerRequest(parse, iterations / 10);
+	
+	const double legacy = nsPerRequest(legacyParse, iterations);
+	const double current = nsPerRequest(parse, iterations);
+	
+	std::cout << std::fixed << std::setprecision(1)
+		<< "legacy parser:  " << std::setw(8) << legacy << " ns/request\n"
+		<< "HttpRequest:    " << std::setw(8) << current << " ns/request\n"
+		<< "speedup:        " << std::setw(8) << legacy / current << "x" << std::endl;
+	
+	return EXIT_SUCCESS;
+}
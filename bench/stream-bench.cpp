@@ -0,0 +1,525 @@
+// Streaming throughput and latency of MJPEGServer over loopback.
+// The synthetic source publishes the frames of the given size at
+// the given rate (or replays the recorded stream, see ReplaySource),
+// the clients pass the Digest handshake and parse the multipart
+// stream. The latency is measured from the frame creation
+// (X-Timestamp part header) until the frame is received.
+//   stream-bench [port] [clients,...] [seconds] [fps] [frame-bytes] [senders] [replay-path]
+// e.g. stream-bench 8092 1,10,100,1000 5 30 100000 2
+
+#include "event-loop.h"
+#include "md5-digest.h"
+#include "mjpeg-server.h"
+#include "replay-source.h"
+
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace
+{
+
+const char* const USERNAME = "bench";
+const char* const PASSWORD = "bench";
+const char* const URI = "/";
+
+const std::size_t RECEIVERS_COUNT = 2;
+const std::chrono::seconds WARM_UP(1);
+
+
+// the client receiving the stream
+struct Connection
+{
+	int sock = -1;
+	std::string header;	// of the part being received
+	std::size_t bodyLeft = 0;
+	long long timestamp = 0;	// of the part being received, us since the epoch
+	unsigned long frames = 0;	// received while measuring
+};
+
+// receives the streams of its share of the clients
+struct Receiver
+{
+	std::vector<std::unique_ptr<Connection>> connections;
+	std::vector<unsigned> latencies;	// us
+	unsigned long bytes = 0;
+	unsigned long errors = 0;
+	std::thread thread;
+};
+
+
+long long wallClockMicroseconds()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+double cpuSeconds(clockid_t clock)
+{
+	struct timespec ts = { 0 };
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double threadCpuSeconds(std::thread& thread)
+{
+	clockid_t clock;
+	if (pthread_getcpuclockid(thread.native_handle(), &clock) != 0)
+	{
+		return 0;
+	}
+	
+	return cpuSeconds(clock);
+}
+
+int connectTo(unsigned short port)
+{
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock == -1)
+	{
+		perror("socket()");
+		throw std::runtime_error("Could not create socket.");
+	}
+	
+	// reset on close, so the client side doesn't run out of ports in TIME_WAIT
+	struct linger lin = { 1, 0 };
+	setsockopt(sock, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+	
+	struct sockaddr_in addr = { 0 };
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	
+	if (connect(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1)
+	{
+		perror("connect()");
+		close(sock);
+		throw std::runtime_error("Could not connect to the server.");
+	}
+	
+	return sock;
+}
+
+// send the request, return the response headers and the data following them
+std::string exchange(int sock, const std::string& request, std::string& rest)
+{
+	if (send(sock, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size()))
+	{
+		throw std::runtime_error("Could not send the request.");
+	}
+	
+	std::string response;
+	std::size_t end = std::string::npos;
+	char buffer[4096];
+	while ((end = response.find("\r\n\r\n")) == std::string::npos)
+	{
+		ssize_t nbytes = recv(sock, buffer, sizeof(buffer), 0);
+		if (nbytes <= 0)
+		{
+			throw std::runtime_error("Connection closed by the server.");
+		}
+		
+		response.append(buffer, nbytes);
+	}
+	
+	rest = response.substr(end + 4);
+	response.erase(end + 4);
+	return response;
+}
+
+// the challenge and the authorized request on the same (persistent) connection
+std::unique_ptr<Connection> openStream(unsigned short port, std::string& rest)
+{
+	std::unique_ptr<Connection> connection(new Connection());
+	connection->sock = connectTo(port);
+	
+	// the status line parses as method, url and version
+	const std::string challenge = exchange(connection->sock,
+		"GET / HTTP/1.1\r\nHost: localhost\r\n\r\n", rest);
+	
+	HttpRequest response;
+	DigestParams params;
+	StringRef authenticate;
+	if (!response.parse(challenge) || !response.url().equals("401")
+		|| (authenticate = response.header("WWW-Authenticate")).size() < 7
+		|| !params.parse(authenticate.substr(7)))
+	{
+		close(connection->sock);
+		throw std::runtime_error("Unexpected challenge.");
+	}
+	
+	const std::string realm = params.get("realm").str();
+	const std::string nonce = params.get("nonce").str();
+	const std::string opaque = params.get("opaque").str();
+	const char* const nc = "00000001";
+	const char* const cnonce = "0a4f113b";
+	
+	MD5Digest md5;
+	const MD5Digest::Hex ha1 = md5.update(USERNAME).update(':').update(realm)
+		.update(':').update(PASSWORD).finish();
+	const MD5Digest::Hex ha2 = md5.update("GET:").update(URI).finish();
+	const MD5Digest::Hex digest = md5.update(ha1).update(':').update(nonce).update(':')
+		.update(nc).update(':').update(cnonce).update(":auth:").update(ha2).finish();
+	
+	const std::string request = std::string("GET ") + URI + " HTTP/1.1\r\n"
+		"Host: localhost\r\n"
+		"Authorization: Digest username=\"" + USERNAME + "\", realm=\"" + realm
+			+ "\", nonce=\"" + nonce + "\", uri=\"" + URI + "\", algorithm=MD5, response=\""
+			+ std::string(digest.data(), digest.size()) + "\", opaque=\"" + opaque
+			+ "\", qop=auth, nc=" + nc + ", cnonce=\"" + cnonce + "\"\r\n"
+		"\r\n";
+	
+	if (exchange(connection->sock, request, rest).compare(0, 12, "HTTP/1.0 200") != 0)
+	{
+		close(connection->sock);
+		throw std::runtime_error("The stream is not authorized.");
+	}
+	
+	return connection;
+}
+
+// parse the received part of the stream
+void consume(Connection& connection, Receiver& receiver, const char* data, std::size_t size,
+			bool measuring)
+{
+	while (size != 0)
+	{
+		if (connection.bodyLeft != 0)
+		{
+			const std::size_t n = std::min(size, connection.bodyLeft);
+			connection.bodyLeft -= n;
+			data += n;
+			size -= n;
+			
+			if (connection.bodyLeft == 0 && measuring)
+			{
+				connection.frames++;
+				receiver.latencies.push_back(static_cast<unsigned>(
+					std::max(wallClockMicroseconds() - connection.timestamp, 0LL)));
+			}
+			continue;
+		}
+		
+		// accumulate the part header until its end
+		const std::size_t before = connection.header.size();
+		connection.header.append(data, size);
+		const std::size_t end = connection.header.find("\r\n\r\n");
+		if (end == std::string::npos)
+		{
+			return;
+		}
+		
+		const std::size_t used = end + 4 - before;
+		data += used;
+		size -= used;
+		connection.header.erase(end + 2);
+		
+		const std::size_t length = connection.header.find("Content-Length: ");
+		connection.bodyLeft = length != std::string::npos
+			? std::strtoul(connection.header.c_str() + length + 16, nullptr, 10) : 0;
+		
+		long long seconds = 0;
+		long long microseconds = 0;
+		const std::size_t timestamp = connection.header.find("X-Timestamp: ");
+		if (timestamp != std::string::npos && std::sscanf(connection.header.c_str() + timestamp + 13,
+				"%lld.%lld", &seconds, &microseconds) == 2)
+		{
+			connection.timestamp = seconds * 1000000 + microseconds;
+		}
+		
+		connection.header.clear();
+	}
+}
+
+void receive(Receiver& receiver, const std::atomic<bool>& running, const std::atomic<bool>& measuring)
+{
+	EventLoop eventLoop;
+	std::vector<Connection*> bySocket;
+	for (const std::unique_ptr<Connection>& connection : receiver.connections)
+	{
+		eventLoop.add(connection->sock, EPOLLIN | EPOLLRDHUP | EPOLLET);
+		if (static_cast<std::size_t>(connection->sock) >= bySocket.size())
+		{
+			bySocket.resize(connection->sock + 1, nullptr);
+		}
+		bySocket[connection->sock] = connection.get();
+	}
+	
+	std::vector<char> buffer(256 * 1024);
+	while (running)
+	{
+		const int n = eventLoop.wait(100);
+		const bool measured = measuring;
+		
+		for (int i = 0; i < n; i++)
+		{
+			Connection* connection = bySocket[eventLoop.event(i).data.fd];
+			while (true)
+			{
+				ssize_t nbytes = recv(connection->sock, buffer.data(), buffer.size(), 0);
+				if (nbytes > 0)
+				{
+					if (measured)
+					{
+						receiver.bytes += nbytes;
+					}
+					consume(*connection, receiver, buffer.data(), nbytes, measured);
+					continue;
+				}
+				
+				if (nbytes < 0 && errno == EINTR)
+				{
+					continue;
+				}
+				
+				if (nbytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+				{
+					// the server dropped the client
+					receiver.errors++;
+					eventLoop.remove(connection->sock);
+				}
+				
+				break;
+			}
+		}
+	}
+}
+
+void raiseDescriptorsLimit()
+{
+	// two descriptors per client within the process
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+std::vector<unsigned> parseCounts(const char* s)
+{
+	std::vector<unsigned> counts;
+	char* end = nullptr;
+	for (unsigned long n = std::strtoul(s, &end, 10); n != 0; n = std::strtoul(s, &end, 10))
+	{
+		counts.push_back(n);
+		s = *end == ',' ? end + 1 : end;
+	}
+	return counts;
+}
+
+void run(unsigned short port, unsigned clientsCount, int seconds, unsigned fps,
+		std::size_t frameSize, std::size_t sendersCount, const std::string& replayPath)
+{
+	std::unique_ptr<ReplaySource> replaySource;
+	if (!replayPath.empty())
+	{
+		replaySource.reset(new ReplaySource(replayPath));
+		replaySource->setFps(fps);
+	}
+	
+	MJPEGServer server(port);
+	server.setCredentials({ std::string(USERNAME) + ":" + PASSWORD });
+	server.setFrameHeaders(true);
+	server.setSendersCount(sendersCount);
+	server.setMaxClients(clientsCount + 1);
+	server.start();
+	
+	// the synthetic source, the frames look like JPEG
+	std::atomic<bool> running(true);
+	std::thread source(
+		[&server, &running, &replaySource, fps, frameSize]()
+		{
+			if (replaySource)
+			{
+				while (running)
+				{
+					server.putFrame(replaySource->captureFrame());
+				}
+				return;
+			}
+			
+			std::vector<unsigned char> jpeg(std::max<std::size_t>(frameSize, 4), 0x55);
+			jpeg[0] = 0xFF;
+			jpeg[1] = 0xD8;
+			jpeg[jpeg.size() - 2] = 0xFF;
+			jpeg[jpeg.size() - 1] = 0xD9;
+			
+			FramePool framePool;
+			const std::chrono::steady_clock::duration interval =
+				std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+					std::chrono::seconds(1)) / fps;
+			std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+			while (running)
+			{
+				server.putFrame(framePool.copyFrame(jpeg.data(), jpeg.size()));
+				next += interval;
+				std::this_thread::sleep_until(next);
+			}
+		});
+	
+	std::vector<Receiver> receivers(std::min<std::size_t>(RECEIVERS_COUNT, clientsCount));
+	try
+	{
+		for (unsigned i = 0; i < clientsCount; i++)
+		{
+			std::string rest;
+			std::unique_ptr<Connection> connection = openStream(port, rest);
+			fcntl(connection->sock, F_SETFL, fcntl(connection->sock, F_GETFL) | O_NONBLOCK);
+			
+			Receiver& receiver = receivers[i % receivers.size()];
+			consume(*connection, receiver, rest.data(), rest.size(), false);
+			receiver.connections.push_back(std::move(connection));
+		}
+	}
+	catch (...)
+	{
+		running = false;
+		source.join();
+		throw;
+	}
+	
+	std::atomic<bool> receiving(true);
+	std::atomic<bool> measuring(false);
+	for (Receiver& receiver : receivers)
+	{
+		receiver.thread = std::thread(receive, std::ref(receiver), std::cref(receiving), std::cref(measuring));
+	}
+	
+	std::this_thread::sleep_for(WARM_UP);
+	
+	// the server CPU is the process CPU except the source and the clients
+	double benchCpu = -threadCpuSeconds(source) - cpuSeconds(CLOCK_THREAD_CPUTIME_ID);
+	for (Receiver& receiver : receivers)
+	{
+		benchCpu -= threadCpuSeconds(receiver.thread);
+	}
+	double processCpu = -cpuSeconds(CLOCK_PROCESS_CPUTIME_ID);
+	measuring = true;
+	
+	std::this_thread::sleep_for(std::chrono::seconds(seconds));
+	
+	measuring = false;
+	processCpu += cpuSeconds(CLOCK_PROCESS_CPUTIME_ID);
+	benchCpu += threadCpuSeconds(source) + cpuSeconds(CLOCK_THREAD_CPUTIME_ID);
+	for (Receiver& receiver : receivers)
+	{
+		benchCpu += threadCpuSeconds(receiver.thread);
+	}
+	
+	receiving = false;
+	for (Receiver& receiver : receivers)
+	{
+		receiver.thread.join();
+	}
+	
+	running = false;
+	source.join();
+	server.stop();
+	
+	std::vector<unsigned> latencies;
+	unsigned long bytes = 0;
+	unsigned long errors = 0;
+	unsigned long minFrames = static_cast<unsigned long>(-1);
+	unsigned long frames = 0;
+	for (Receiver& receiver : receivers)
+	{
+		latencies.insert(latencies.end(), receiver.latencies.begin(), receiver.latencies.end());
+		bytes += receiver.bytes;
+		errors += receiver.errors;
+		for (const std::unique_ptr<Connection>& connection : receiver.connections)
+		{
+			frames += connection->frames;
+			minFrames = std::min(minFrames, connection->frames);
+			close(connection->sock);	// after the server, so it doesn't complain on reset
+		}
+	}
+	
+	std::sort(latencies.begin(), latencies.end());
+	const double p50 = latencies.empty() ? 0 : latencies[latencies.size() / 2] / 1000.0;
+	const double p99 = latencies.empty() ? 0 : latencies[latencies.size() * 99 / 100] / 1000.0;
+	
+	std::printf(
+		"%5u clients: %6.2f fps/client (min %6.2f), %9.1f Mbit/s, "
+		"latency p50 %7.2f ms p99 %7.2f ms, server CPU %6.1f%%, %lu disconnected\n",
+		clientsCount, static_cast<double>(frames) / clientsCount / seconds,
+		static_cast<double>(minFrames) / seconds, bytes * 8 / 1e6 / seconds, p50, p99,
+		(processCpu - benchCpu) * 100 / seconds, errors);
+	std::fflush(stdout);
+}
+
+}
+
+
+int main(int argc, char* argv[])
+{
+	const unsigned short port = argc > 1 ? std::atoi(argv[1]) : 8092;
+	const std::vector<unsigned> clientsCounts = parseCounts(argc > 2 ? argv[2] : "1,10,100,1000");
+	const int seconds = argc > 3 ? std::atoi(argv[3]) : 5;
+	const unsigned fps = argc > 4 ? std::atoi(argv[4]) : 30;
+	const std::size_t frameSize = argc > 5 ? std::strtoul(argv[5], nullptr, 10) : 100000;
+	const std::size_t sendersCount = argc > 6 ? std::strtoul(argv[6], nullptr, 10)
+		: MJPEGServer::DEFAULT_SENDERS_COUNT;
+	const std::string replayPath = argc > 7 ? argv[7] : "";
+	
+	if (clientsCounts.empty() || seconds <= 0 || fps == 0)
+	{
+		std::cerr << "usage: " << argv[0]
+			<< " [port] [clients,...] [seconds] [fps] [frame-bytes] [senders] [replay-path]" << std::endl;
+		return EXIT_FAILURE;
+	}
+	
+	raiseDescriptorsLimit();
+	
+	// the server logs every client, keep it out of the results
+	std::streambuf* coutBuffer = std::cout.rdbuf(nullptr);
+	
+	if (replayPath.empty())
+	{
+		std::printf("%u fps, %zu bytes per frame, %zu sender(s)\n", fps, frameSize, sendersCount);
+	}
+	else
+	{
+		std::printf("%u fps, %s replayed, %zu sender(s)\n", fps, replayPath.c_str(), sendersCount);
+	}
+	
+	try
+	{
+		// the new port for every run, the previous one may be still in use
+		for (std::size_t i = 0; i < clientsCounts.size(); i++)
+		{
+			run(port + i, clientsCounts[i], seconds, fps, frameSize, sendersCount, replayPath);
+		}
+	}
+	catch (const std::exception& ex)
+	{
+		std::cout.rdbuf(coutBuffer);
+		std::cout.clear();
+		std::cerr << ex.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	
+	std::cout.rdbuf(coutBuffer);
+	std::cout.clear();
+	return EXIT_SUCCESS;
+}
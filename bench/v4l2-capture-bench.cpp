@@ -0,0 +1,136 @@
+// Capture throughput of V4L2Camera depending on the I/O method
+// (mmap, userptr, dmabuf) and the number of buffers. Run against 
+// the vivid virtual driver (modprobe vivid) or a real camera:
+//   v4l2-capture-bench [device] [seconds-per-run]
+
+#include "v4l2-camera.h"
+
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+
+namespace
+{
+
+double cpuSeconds()
+{
+	struct rusage usage = { 0 };
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+		+ (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+}
+
+
+int main(int argc, char* argv[])
+{
+	const char* deviceName = argc > 1 ? argv[1] : "/dev/video0";
+	const int seconds = argc > 2 ? std::atoi(argv[2]) : 5;
+	const unsigned buffersCounts[] = { 1, 2, 4, 8 };
+	const V4L2Camera::IoMethod ioMethods[] = 
+	{ 
+		V4L2Camera::IoMethod::Mmap, 
+		V4L2Camera::IoMethod::UserPtr, 
+		V4L2Camera::IoMethod::DmaBuf 
+	};
+	const char* const ioMethodNames[] = { "mmap", "userptr", "dmabuf" };
+	
+	struct Result
+	{
+		const char* ioMethod;
+		unsigned buffers;
+		double fps;
+		double cpuLoad;
+		double cpuPerFrame;
+		double copiesPerFrame;
+	};
+	
+	std::vector<Result> results;
+	
+	for (std::size_t m = 0; m < sizeof(ioMethods) / sizeof(ioMethods[0]); m++)
+	{
+		for (unsigned buffersCount : buffersCounts)
+		{
+			try
+			{
+				V4L2Camera camera;
+				camera.openDevice(deviceName);
+				camera.setupCaptureFormat();
+				camera.setupCaptureBuffer(buffersCount, ioMethods[m]);
+				camera.startCapturing();
+				
+				// the consumer holds the latest frame, as the frame slot of the server does
+				FramePtr frame;
+				
+				// skip the first frames, the driver may need time to warm up
+				for (int i = 0; i < 5; i++)
+				{
+					frame = camera.captureFrame();
+				}
+				
+				const std::uint64_t frames0 = camera.framesCaptured();
+				const std::uint64_t copies0 = camera.framesCopied();
+				const double cpu0 = cpuSeconds();
+				const std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+				const std::chrono::steady_clock::time_point deadline = t0 + std::chrono::seconds(seconds);
+				
+				while (std::chrono::steady_clock::now() < deadline)
+				{
+					FramePtr captured = camera.captureFrame();
+					if (captured)
+					{
+						frame = std::move(captured);
+					}
+				}
+				
+				const double wall = std::chrono::duration<double>(
+					std::chrono::steady_clock::now() - t0).count();
+				const double cpu = cpuSeconds() - cpu0;
+				const std::uint64_t frames = camera.framesCaptured() - frames0;
+				const std::uint64_t copies = camera.framesCopied() - copies0;
+				
+				frame.reset();
+				camera.stopCapturing();
+				
+				Result result;
+				result.ioMethod = ioMethodNames[m];
+				result.buffers = static_cast<unsigned>(camera.buffersCount());
+				result.fps = frames / wall;
+				result.cpuLoad = 100.0 * cpu / wall;
+				result.cpuPerFrame = frames != 0 ? 1e6 * cpu / frames : 0.0;
+				result.copiesPerFrame = frames != 0 ? static_cast<double>(copies) / frames : 0.0;
+				results.push_back(result);
+			}
+			catch (const std::exception& ex)
+			{
+				// the device may not support the I/O method, the others are still measured
+				std::cerr << "Exception (" << ioMethodNames[m] << ", " << buffersCount 
+					<< " buffers): " << ex.what() << std::endl;
+			}
+		}
+	}
+	
+	std::cout << "\n  method | buffers |    fps | CPU, % | CPU per frame, us | copies per frame\n"
+			<< "-------------------------------------------------------------------------\n";
+	for (const Result& result : results)
+	{
+		std::cout << std::fixed << std::setprecision(1)
+			<< ' ' << std::setw(7) << result.ioMethod << " | "
+			<< std::setw(7) << result.buffers << " | "
+			<< std::setw(6) << result.fps << " | "
+			<< std::setw(6) << result.cpuLoad << " | "
+			<< std::setw(17) << result.cpuPerFrame << " | "
+			<< std::setprecision(2) << std::setw(16) << result.copiesPerFrame << '\n';
+	}
+	std::cout << std::endl;
+	
+	return 0;
+}
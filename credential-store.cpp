@@ -0,0 +1,97 @@
+#include "credential-store.h"
+
+
+namespace
+{
+
+bool isHex(StringRef s)
+{
+	for (std::size_t i = 0; i < s.size(); i++)
+	{
+		const char c = s[i];
+		if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')))
+		{
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+}
+
+
+const std::size_t CredentialStore::HA1_SIZE;
+
+
+bool CredentialStore::add(const std::string& line)
+{
+	const std::size_t p0 = line.find(':');
+	if (p0 == std::string::npos || p0 == 0)
+	{
+		return false;
+	}
+	
+	const std::string username = line.substr(0, p0);
+	
+	// htdigest line ends with 32 hex digits after the realm
+	const std::size_t p1 = line.rfind(':');
+	if (p1 != p0 && line.size() - p1 - 1 == HA1_SIZE)
+	{
+		const StringRef ha1 = StringRef(line).substr(p1 + 1);
+		if (isHex(ha1))
+		{
+			if (line.compare(p0 + 1, p1 - p0 - 1, _realm) != 0)
+			{
+				return false;
+			}
+			
+			return addHA1(username, ha1);
+		}
+	}
+	
+	return addPassword(username, line.substr(p0 + 1));
+}
+
+bool CredentialStore::addPassword(const std::string& username, const std::string& password)
+{
+	MD5Digest md5;
+	const MD5Digest::Hex ha1 = md5.update(username).update(':')
+		.update(_realm).update(':').update(password).finish();
+	
+	return addHA1(username, StringRef(ha1.data(), ha1.size()));
+}
+
+bool CredentialStore::addHA1(const std::string& username, StringRef ha1)
+{
+	if (username.empty() || ha1.size() != HA1_SIZE || !isHex(ha1))
+	{
+		return false;
+	}
+	
+	HA1 value;
+	for (std::size_t i = 0; i < HA1_SIZE; i++)
+	{
+		// the response is compared with lower case hex
+		const char c = ha1[i];
+		value[i] = (c >= 'A' && c <= 'F') ? static_cast<char>(c - 'A' + 'a') : c;
+	}
+	
+	std::unordered_map<StringRef, HA1, StringRefHash, StringRefEqual>::iterator it = _users.find(username);
+	if (it != _users.end())
+	{
+		// the later line overrides
+		it->second = value;
+		return true;
+	}
+	
+	_usernames.push_back(username);
+	_users.emplace(_usernames.back(), value);
+	return true;
+}
+
+const CredentialStore::HA1* CredentialStore::find(StringRef username) const
+{
+	std::unordered_map<StringRef, HA1, StringRefHash, StringRefEqual>::const_iterator it = _users.find(username);
+	return it != _users.end() ? &it->second : nullptr;
+}
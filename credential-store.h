@@ -0,0 +1,61 @@
+#pragma once
+
+#include "http-request.h"
+#include "md5-digest.h"
+
+#include <cstddef>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+
+// Users of HTTP Digest authentication with precomputed
+// HA1 = MD5(username:realm:password), looked up by exact username.
+class CredentialStore final
+{
+public:
+	static const std::size_t HA1_SIZE = MD5Digest::HEX_SIZE;
+	using HA1 = MD5Digest::Hex;
+	
+public:
+	CredentialStore(const CredentialStore&) = delete;
+	CredentialStore& operator=(const CredentialStore&) = delete;
+	
+	explicit CredentialStore(const std::string& realm)
+		: _realm(realm)
+	{
+	}
+	
+	const std::string& realm() const
+	{
+		return _realm;
+	}
+	
+	// the line of a credentials file, either 'username:password' or
+	// 'username:realm:HA1' (htdigest format). return false if the line
+	// is malformed or belongs to another realm.
+	bool add(const std::string& line);
+	
+	bool addPassword(const std::string& username, const std::string& password);
+	bool addHA1(const std::string& username, StringRef ha1);
+	
+	// nullptr if there is no such user
+	const HA1* find(StringRef username) const;
+	
+	std::size_t size() const
+	{
+		return _users.size();
+	}
+	
+	void clear()
+	{
+		_users.clear();
+		_usernames.clear();
+	}
+	
+private:
+	std::string _realm;
+	// the keys of _users refer to these strings
+	std::list<std::string> _usernames;
+	std::unordered_map<StringRef, HA1, StringRefHash, StringRefEqual> _users;
+};
@@ -0,0 +1,140 @@
+#include "encoder-pool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <stdexcept>
+
+
+EncoderPool::EncoderPool(const JpegEncoder::Settings& settings, std::size_t threadsCount, 
+						std::size_t maxQueued, std::mutex& outMutex, Sink sink)
+	: _outMutex(outMutex)
+	, _sink(std::move(sink))
+	, _maxQueued(std::max<std::size_t>(maxQueued, 1))
+{
+	assert(_sink);
+	
+	for (std::size_t i = 0; i < std::max<std::size_t>(threadsCount, 1); i++)
+	{
+		_encoders.emplace_back(new JpegEncoder(settings));
+	}
+}
+
+EncoderPool::~EncoderPool()
+{
+	stop();
+}
+
+void EncoderPool::start()
+{
+	if (!_threads.empty())
+	{
+		throw std::logic_error("Encoder pool already started.");
+	}
+	
+	_stopRequested = false;
+	for (std::unique_ptr<JpegEncoder>& encoder : _encoders)
+	{
+		_threads.emplace_back(&EncoderPool::encodeLoop, this, std::ref(*encoder));
+	}
+}
+
+void EncoderPool::stop()
+{
+	{
+		std::lock_guard<std::mutex> lg(_queueMutex);
+		_stopRequested = true;
+		_queue.clear();
+	}
+	_queueCondition.notify_all();
+	
+	for (std::thread& thread : _threads)
+	{
+		thread.join();
+	}
+	_threads.clear();
+}
+
+void EncoderPool::submit(FramePtr raw)
+{
+	assert(raw);
+	
+	{
+		std::lock_guard<std::mutex> lg(_queueMutex);
+		if (_queue.size() >= _maxQueued)
+		{
+			_queue.pop_front();
+			_framesDropped.fetch_add(1, std::memory_order_relaxed);
+		}
+		_queue.push_back(std::move(raw));
+	}
+	_queueCondition.notify_one();
+}
+
+void EncoderPool::encodeLoop(JpegEncoder& encoder)
+{
+	while (true)
+	{
+		FramePtr raw;
+		std::uint64_t ticket = 0;
+		
+		{
+			std::unique_lock<std::mutex> lock(_queueMutex);
+			_queueCondition.wait(lock,
+				[this]()
+				{
+					return _stopRequested || !_queue.empty();
+				});
+			
+			if (_stopRequested)
+			{
+				return;
+			}
+			
+			raw = std::move(_queue.front());
+			_queue.pop_front();
+			ticket = _nextTicket++;
+		}
+		
+		FramePtr frame;
+		try
+		{
+			frame = encoder.encode(*raw);
+			_framesEncoded.fetch_add(1, std::memory_order_relaxed);
+		}
+		catch (const std::exception& ex)
+		{
+			// the bad frames come at the frame rate, only the first error is logged
+			if (_encodeErrors.fetch_add(1, std::memory_order_relaxed) == 0)
+			{
+				std::lock_guard<std::mutex> lg(_outMutex);
+				std::cerr << "Exception (encoder): " << ex.what() 
+					<< " The further errors are only counted." << std::endl;
+			}
+		}
+		
+		// the capture buffer is returned before waiting for the frames ahead
+		raw.reset();
+		
+		deliver(ticket, std::move(frame));
+	}
+}
+
+void EncoderPool::deliver(std::uint64_t ticket, FramePtr frame)
+{
+	std::lock_guard<std::mutex> lg(_deliveryMutex);
+	_encoded.emplace(ticket, std::move(frame));
+	
+	// the frames encoded faster than the previous ones wait for them
+	std::map<std::uint64_t, FramePtr>::iterator it = _encoded.begin();
+	while (it != _encoded.end() && it->first == _nextDelivery)
+	{
+		if (it->second)
+		{
+			_sink(std::move(it->second));
+		}
+		
+		it = _encoded.erase(it);
+		_nextDelivery++;
+	}
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "frame.h"
+#include "jpeg-encoder.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Encodes the raw frames by the pool of threads, every one with own
+// encoder. The encoded frames are passed to the sink in the order they
+// are submitted, so the frame N is published (and sent) while the next
+// ones are encoded. When all the threads are busy and maxQueued frames
+// wait, the oldest waiting one is dropped, so the latency does not grow
+// and the capture buffers the frames refer to are not exhausted.
+// The counters are exported by the server, see MJPEGServer::setEncoder.
+class EncoderPool final
+{
+public:
+	// called by the encoding threads, one at a time
+	using Sink = std::function<void (FramePtr frame)>;
+	
+public:
+	EncoderPool(const EncoderPool&) = delete;
+	EncoderPool& operator=(const EncoderPool&) = delete;
+	
+	// throw if the encoder can't be created (e.g. no libjpeg).
+	// the errors are written to std::cerr under the output mutex.
+	EncoderPool(const JpegEncoder::Settings& settings, std::size_t threadsCount, 
+				std::size_t maxQueued, std::mutex& outMutex, Sink sink);
+	~EncoderPool();
+	
+	void start();
+	// the frames waiting for encoding are dropped
+	void stop();
+	
+	// queue the raw frame (thread-safe)
+	void submit(FramePtr raw);
+	
+	std::uint64_t framesEncoded() const
+	{
+		return _framesEncoded.load(std::memory_order_relaxed);
+	}
+	
+	std::uint64_t framesDropped() const
+	{
+		return _framesDropped.load(std::memory_order_relaxed);
+	}
+	
+	std::uint64_t encodeErrors() const
+	{
+		return _encodeErrors.load(std::memory_order_relaxed);
+	}
+	
+private:
+	void encodeLoop(JpegEncoder& encoder);
+	// pass the encoded frames to the sink in order, nullptr if encoding failed
+	void deliver(std::uint64_t ticket, FramePtr frame);
+	
+private:
+	std::vector<std::unique_ptr<JpegEncoder>> _encoders;
+	std::vector<std::thread> _threads;
+	std::mutex& _outMutex;
+	Sink _sink;
+	
+	std::mutex _queueMutex;
+	std::condition_variable _queueCondition;
+	std::deque<FramePtr> _queue;
+	std::size_t _maxQueued = 0;
+	std::uint64_t _nextTicket = 0;	// in the order the frames are taken from the queue
+	bool _stopRequested = false;
+	
+	std::mutex _deliveryMutex;
+	std::map<std::uint64_t, FramePtr> _encoded;	// ahead of the next delivered
+	std::uint64_t _nextDelivery = 0;
+	
+	std::atomic<std::uint64_t> _framesEncoded{0};
+	std::atomic<std::uint64_t> _framesDropped{0};
+	std::atomic<std::uint64_t> _encodeErrors{0};
+};
@@ -0,0 +1,121 @@
+#include "event-loop.h"
+
+#include <sys/eventfd.h>
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <stdexcept>
+
+
+const std::size_t EventLoop::MAX_EVENTS = 64;
+
+
+EventLoop::EventLoop()
+	: _events(MAX_EVENTS)
+{
+	if ((_epollFd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+	{
+		perror("epoll_create1()");
+		throw std::runtime_error("Could not create event loop.");
+	}
+}
+
+EventLoop::~EventLoop()
+{
+	for (int fd : _eventFds)
+	{
+		close(fd);
+	}
+	
+	close(_epollFd);
+}
+
+void EventLoop::add(int fd, unsigned events)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	
+	if (epoll_ctl(_epollFd, EPOLL_CTL_ADD, fd, &ev) == -1)
+	{
+		perror("epoll_ctl()");
+		throw std::runtime_error("Could not add descriptor to event loop.");
+	}
+}
+
+void EventLoop::modify(int fd, unsigned events)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	
+	if (epoll_ctl(_epollFd, EPOLL_CTL_MOD, fd, &ev) == -1)
+	{
+		perror("epoll_ctl()");
+		throw std::runtime_error("Could not modify descriptor in event loop.");
+	}
+}
+
+void EventLoop::remove(int fd)
+{
+	if (epoll_ctl(_epollFd, EPOLL_CTL_DEL, fd, NULL) == -1)
+	{
+		perror("epoll_ctl()");
+		throw std::runtime_error("Could not remove descriptor from event loop.");
+	}
+}
+
+int EventLoop::wait(int timeout/* = -1*/)
+{
+	int n = epoll_wait(_epollFd, _events.data(), _events.size(), timeout);
+	if (n == -1)
+	{
+		if (errno == EINTR)
+		{
+			return 0;
+		}
+		
+		perror("epoll_wait()");
+		throw std::runtime_error("Could not wait for events.");
+	}
+	
+	return n;
+}
+
+int EventLoop::createEvent()
+{
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd == -1)
+	{
+		perror("eventfd()");
+		throw std::runtime_error("Could not create event descriptor.");
+	}
+	
+	_eventFds.push_back(fd);
+	add(fd, EPOLLIN | EPOLLET);
+	
+	return fd;
+}
+
+void EventLoop::signalEvent(int fd)
+{
+	const std::uint64_t value = 1;
+	while (write(fd, &value, sizeof(value)) == -1 && errno == EINTR)
+	{
+	}
+}
+
+void EventLoop::drainEvent(int fd)
+{
+	std::uint64_t value = 0;
+	while (read(fd, &value, sizeof(value)) == -1 && errno == EINTR)
+	{
+	}
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <sys/epoll.h>
+
+#include <vector>
+
+
+// The edge-triggered epoll set together with the eventfd descriptors
+// used to wake up the loop from other threads.
+class EventLoop final
+{
+	static const std::size_t MAX_EVENTS;
+	
+public:
+	EventLoop(const EventLoop&) = delete;
+	EventLoop& operator=(const EventLoop&) = delete;
+	
+	EventLoop();
+	~EventLoop();
+	
+	void add(int fd, unsigned events);
+	void modify(int fd, unsigned events);
+	void remove(int fd);
+	
+	// wait for events (timeout in milliseconds, -1 - infinite).
+	// return the number of ready events, 0 if interrupted or timeout expired.
+	int wait(int timeout = -1);
+	
+	const struct epoll_event& event(int i) const
+	{
+		return _events[i];
+	}
+	
+	// eventfd descriptor, it's added to the loop
+	int createEvent();
+	
+	static void signalEvent(int fd);
+	static void drainEvent(int fd);
+	
+private:
+	int _epollFd = -1;
+	std::vector<int> _eventFds;
+	std::vector<struct epoll_event> _events;
+};
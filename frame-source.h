@@ -0,0 +1,18 @@
+#pragma once
+
+#include "frame.h"
+
+
+// The producer of the frames published by the server: the camera,
+// the recorded stream, etc. The frames are captured by one thread.
+class FrameSource
+{
+public:
+	virtual ~FrameSource() = default;
+	
+	virtual void startCapturing() = 0;
+	virtual void stopCapturing() = 0;
+	
+	// wait for the next frame, return nullptr if timeout expired
+	virtual FramePtr captureFrame() = 0;
+};
@@ -0,0 +1,164 @@
+#include "frame.h"
+
+#include <algorithm>
+#include <cassert>
+
+
+Frame::Frame(const unsigned char* data, std::size_t size, Releaser releaser)
+	: _data(data)
+	, _size(size)
+	, _releaser(std::move(releaser))
+	, _createdAt(std::chrono::steady_clock::now())
+	, _capturedAt(_createdAt)
+{
+	assert(data != nullptr);
+}
+
+Frame::Frame(std::vector<unsigned char>&& storage, Releaser releaser/* = nullptr*/)
+	: _storage(std::move(storage))
+	, _data(_storage.data())
+	, _size(_storage.size())
+	, _releaser(std::move(releaser))
+	, _createdAt(std::chrono::steady_clock::now())
+	, _capturedAt(_createdAt)
+{
+}
+
+void Frame::setCaptureInfo(std::chrono::steady_clock::time_point capturedAt, std::uint32_t sequence)
+{
+	// the timestamp of another clock may be in the future
+	_capturedAt = std::min(capturedAt, _createdAt);
+	_captureSequence = sequence;
+	_hasCaptureSequence = true;
+}
+
+void Frame::setCaptureInfo(const Frame& source)
+{
+	_capturedAt = std::min(source._capturedAt, _createdAt);
+	_captureSequence = source._captureSequence;
+	_hasCaptureSequence = source._hasCaptureSequence;
+}
+
+bool Frame::findVariant(std::uint32_t key, std::shared_ptr<const Frame>& variant) const
+{
+	std::lock_guard<std::mutex> lg(_variantsMutex);
+	for (const std::pair<std::uint32_t, std::shared_ptr<const Frame>>& v : _variants)
+	{
+		if (v.first == key)
+		{
+			variant = v.second;
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+void Frame::addVariant(std::uint32_t key, std::shared_ptr<const Frame> variant) const
+{
+	std::lock_guard<std::mutex> lg(_variantsMutex);
+	for (const std::pair<std::uint32_t, std::shared_ptr<const Frame>>& v : _variants)
+	{
+		if (v.first == key)
+		{
+			return;
+		}
+	}
+	
+	_variants.emplace_back(key, std::move(variant));
+}
+
+Frame::~Frame()
+{
+	if (_releaser)
+	{
+		_releaser(_storage);
+	}
+}
+
+
+FramePool::FramePool(std::size_t maxBuffers/* = 8*/)
+	: _storage(std::make_shared<Storage>())
+{
+	_storage->maxBuffers = maxBuffers;
+}
+
+std::shared_ptr<Frame> FramePool::copyFrame(const unsigned char* data, std::size_t size)
+{
+	std::vector<unsigned char> buffer = takeStorage();
+	buffer.assign(data, data + size);
+	return makeFrame(std::move(buffer));
+}
+
+std::vector<unsigned char> FramePool::takeStorage()
+{
+	std::vector<unsigned char> buffer;
+	
+	std::lock_guard<std::mutex> lg(_storage->mutex);
+	if (!_storage->buffers.empty())
+	{
+		buffer = std::move(_storage->buffers.back());
+		_storage->buffers.pop_back();
+	}
+	
+	return buffer;
+}
+
+std::shared_ptr<Frame> FramePool::makeFrame(std::vector<unsigned char>&& storage)
+{
+	std::weak_ptr<Storage> weakStorage(_storage);
+	return std::make_shared<Frame>(std::move(storage), 
+		[weakStorage](std::vector<unsigned char>& storage)
+		{
+			std::shared_ptr<Storage> s = weakStorage.lock();
+			if (s)
+			{
+				std::lock_guard<std::mutex> lg(s->mutex);
+				if (s->buffers.size() < s->maxBuffers)
+				{
+					s->buffers.push_back(std::move(storage));
+				}
+			}
+		});
+}
+
+
+FrameSlot::FrameSlot()
+	: _sequence(0)
+{
+}
+
+std::uint64_t FrameSlot::publish(FramePtr frame)
+{
+	const std::chrono::steady_clock::time_point publishedAt = std::chrono::steady_clock::now();
+	std::uint64_t sequence = 0;
+	
+	{
+		// the frame and its sequence number are swapped at once
+		std::lock_guard<std::mutex> lg(_publishedMutex);
+		sequence = _published.sequence + 1;
+		_published.frame.swap(frame);
+		_published.sequence = sequence;
+		_published.publishedAt = publishedAt;
+		_sequence.store(sequence, std::memory_order_release);
+	}
+	
+	// the previous frame is released outside the lock (by the last reader, if any)
+	frame.reset();
+	return sequence;
+}
+
+FramePtr FrameSlot::latest(std::uint64_t& sequence) const
+{
+	std::chrono::steady_clock::time_point publishedAt;
+	return latest(sequence, publishedAt);
+}
+
+FramePtr FrameSlot::latest(std::uint64_t& sequence, 
+						std::chrono::steady_clock::time_point& publishedAt) const
+{
+	std::lock_guard<std::mutex> lg(_publishedMutex);
+	sequence = _published.sequence;
+	publishedAt = _published.publishedAt;
+	return _published.frame;
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+
+// Immutable frame data shared between the capture and the stream sides.
+// The frame either owns its storage or refers to external memory
+// (e.g. V4L2 buffer); the releaser is called when the last reference
+// is dropped, so the storage can be returned to its owner.
+class Frame final
+{
+public:
+	using Releaser = std::function<void (std::vector<unsigned char>& storage)>;
+	
+public:
+	Frame(const Frame&) = delete;
+	Frame& operator=(const Frame&) = delete;
+	
+	Frame(const unsigned char* data, std::size_t size, Releaser releaser);
+	explicit Frame(std::vector<unsigned char>&& storage, Releaser releaser = nullptr);
+	~Frame();
+	
+	const unsigned char* data() const
+	{
+		return _data;
+	}
+	
+	std::size_t size() const
+	{
+		return _size;
+	}
+	
+	// when the frame is taken from the source (dequeued from the driver)
+	std::chrono::steady_clock::time_point createdAt() const
+	{
+		return _createdAt;
+	}
+	
+	// when the frame is captured by the source (e.g. V4L2 buffer timestamp),
+	// the creation time unless set
+	std::chrono::steady_clock::time_point capturedAt() const
+	{
+		return _capturedAt;
+	}
+	
+	// the sequence number assigned by the source (e.g. V4L2 buffer sequence),
+	// the gaps are the frames dropped by the source
+	bool hasCaptureSequence() const
+	{
+		return _hasCaptureSequence;
+	}
+	
+	std::uint32_t captureSequence() const
+	{
+		return _captureSequence;
+	}
+	
+	// should be set before the frame is shared
+	void setCaptureInfo(std::chrono::steady_clock::time_point capturedAt, std::uint32_t sequence);
+	// the capture info of the frame this one is derived from
+	void setCaptureInfo(const Frame& source);
+	
+	// the frames derived from this one (e.g. transcoded) are cached with it
+	// by key, so they are made once however many clients need them (thread-safe).
+	// return false if there is no such variant yet, the variant found may be 
+	// null (it could not be made).
+	bool findVariant(std::uint32_t key, std::shared_ptr<const Frame>& variant) const;
+	// the first variant added by the key is kept
+	void addVariant(std::uint32_t key, std::shared_ptr<const Frame> variant) const;
+	
+private:
+	std::vector<unsigned char> _storage;
+	const unsigned char* _data = nullptr;
+	std::size_t _size = 0;
+	Releaser _releaser;
+	std::chrono::steady_clock::time_point _createdAt;
+	std::chrono::steady_clock::time_point _capturedAt;
+	std::uint32_t _captureSequence = 0;
+	bool _hasCaptureSequence = false;
+	
+	// there are few variants, one per tier watched
+	mutable std::mutex _variantsMutex;
+	mutable std::vector<std::pair<std::uint32_t, std::shared_ptr<const Frame>>> _variants;
+};
+
+using FramePtr = std::shared_ptr<const Frame>;
+
+
+// Recycles frame storage, so copying a frame does not allocate
+// memory once the pool is warmed up.
+class FramePool final
+{
+public:
+	FramePool(const FramePool&) = delete;
+	FramePool& operator=(const FramePool&) = delete;
+	
+	explicit FramePool(std::size_t maxBuffers = 8);
+	
+	std::shared_ptr<Frame> copyFrame(const unsigned char* data, std::size_t size);
+	
+	// the recycled storage (maybe empty) to be filled and wrapped with makeFrame()
+	std::vector<unsigned char> takeStorage();
+	std::shared_ptr<Frame> makeFrame(std::vector<unsigned char>&& storage);
+	
+private:
+	// frames may outlive the pool, they refer to the storage weakly
+	struct Storage
+	{
+		std::mutex mutex;
+		std::vector<std::vector<unsigned char>> buffers;
+		std::size_t maxBuffers = 0;
+	};
+	
+	std::shared_ptr<Storage> _storage;
+};
+
+
+// The latest published frame. Subscribers remember the sequence number
+// of the frame they've got last and always jump to the newest one,
+// so the frames are never queued. The readers and the publishers take
+// the slot's own lock just to copy or swap the frame pointer, so it's
+// never held for long. (The atomic shared_ptr functions of libstdc++
+// are not lock-free either, they lock a mutex from a global pool.)
+class FrameSlot final
+{
+public:
+	FrameSlot(const FrameSlot&) = delete;
+	FrameSlot& operator=(const FrameSlot&) = delete;
+	
+	FrameSlot();
+	
+	// return the sequence number assigned to the frame
+	std::uint64_t publish(FramePtr frame);
+	
+	// return the latest frame and its sequence number (0 if nothing published)
+	FramePtr latest(std::uint64_t& sequence) const;
+	FramePtr latest(std::uint64_t& sequence, std::chrono::steady_clock::time_point& publishedAt) const;
+	
+	// the cheap check whether anything new is published
+	std::uint64_t sequence() const
+	{
+		return _sequence.load(std::memory_order_acquire);
+	}
+	
+private:
+	struct Published
+	{
+		FramePtr frame;
+		std::uint64_t sequence = 0;
+		std::chrono::steady_clock::time_point publishedAt;
+	};
+	
+	mutable std::mutex _publishedMutex;
+	Published _published;
+	std::atomic<std::uint64_t> _sequence;
+};
@@ -0,0 +1,248 @@
+#include "http-request.h"
+
+#include <cstdint>
+
+
+namespace
+{
+
+char toLower(char c)
+{
+	return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+bool isSpace(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+StringRef trim(StringRef s)
+{
+	std::size_t b = 0, e = s.size();
+	while (b < e && isSpace(s[b]))
+	{
+		b++;
+	}
+	
+	while (e > b && isSpace(s[e - 1]))
+	{
+		e--;
+	}
+	
+	return s.substr(b, e - b);
+}
+
+}
+
+
+std::size_t StringRef::find(char c, std::size_t pos/* = 0*/) const
+{
+	if (pos >= _size)
+	{
+		return npos;
+	}
+	
+	const void* p = std::memchr(_data + pos, c, _size - pos);
+	return p != nullptr ? static_cast<const char*>(p) - _data : npos;
+}
+
+bool StringRef::iequals(StringRef other) const
+{
+	if (_size != other._size)
+	{
+		return false;
+	}
+	
+	for (std::size_t i = 0; i < _size; i++)
+	{
+		if (toLower(_data[i]) != toLower(other._data[i]))
+		{
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+std::size_t StringRefHash::operator()(StringRef s) const
+{
+	// FNV-1a, folded for 32-bit size_t
+	std::uint64_t h = 14695981039346656037ULL;
+	for (std::size_t i = 0; i < s.size(); i++)
+	{
+		h ^= static_cast<unsigned char>(s[i]);
+		h *= 1099511628211ULL;
+	}
+	
+	return static_cast<std::size_t>(h ^ (h >> 32));
+}
+
+
+bool HttpRequest::parse(StringRef request)
+{
+	_method = _url = _version = StringRef();
+	_headersCount = 0;
+	
+	std::size_t pos = 0;
+	bool requestLine = true;
+	
+	while (pos < request.size())
+	{
+		std::size_t eol = request.find('\n', pos);
+		if (eol == StringRef::npos)
+		{
+			eol = request.size();
+		}
+		
+		// tolerate bare LF line endings
+		StringRef line = request.substr(pos, eol - pos);
+		if (!line.empty() && line[line.size() - 1] == '\r')
+		{
+			line = line.substr(0, line.size() - 1);
+		}
+		
+		pos = eol + 1;
+		
+		if (requestLine)
+		{
+			// method SP url SP version
+			const std::size_t p0 = line.find(' ');
+			const std::size_t p1 = line.find(' ', p0 != StringRef::npos ? p0 + 1 : line.size());
+			if (p0 == StringRef::npos || p1 == StringRef::npos || p0 == 0 || p1 == p0 + 1)
+			{
+				return false;
+			}
+			
+			_method = line.substr(0, p0);
+			_url = line.substr(p0 + 1, p1 - p0 - 1);
+			_version = line.substr(p1 + 1);
+			requestLine = false;
+			continue;
+		}
+		
+		if (line.empty())
+		{
+			// the end of headers
+			break;
+		}
+		
+		const std::size_t colon = line.find(':');
+		if (colon == StringRef::npos || colon == 0)
+		{
+			return false;
+		}
+		
+		if (_headersCount == MAX_HEADERS)
+		{
+			return false;
+		}
+		
+		Header& header = _headers[_headersCount++];
+		header.name = line.substr(0, colon);
+		header.value = trim(line.substr(colon + 1));
+	}
+	
+	return !requestLine;
+}
+
+StringRef HttpRequest::header(StringRef name) const
+{
+	for (std::size_t i = 0; i < _headersCount; i++)
+	{
+		if (_headers[i].name.iequals(name))
+		{
+			return _headers[i].value;
+		}
+	}
+	
+	return StringRef();
+}
+
+
+bool DigestParams::parse(StringRef data)
+{
+	_paramsCount = 0;
+	
+	std::size_t pos = 0;
+	while (true)
+	{
+		// skip separators
+		while (pos < data.size() && (isSpace(data[pos]) || data[pos] == ','))
+		{
+			pos++;
+		}
+		
+		if (pos == data.size())
+		{
+			break;
+		}
+		
+		const std::size_t eq = data.find('=', pos);
+		if (eq == StringRef::npos)
+		{
+			return false;
+		}
+		
+		const StringRef key = trim(data.substr(pos, eq - pos));
+		StringRef value;
+		
+		pos = eq + 1;
+		while (pos < data.size() && isSpace(data[pos]))
+		{
+			pos++;
+		}
+		
+		if (pos < data.size() && data[pos] == '"')
+		{
+			// the quoted value may contain commas
+			const std::size_t quote = data.find('"', pos + 1);
+			if (quote == StringRef::npos)
+			{
+				return false;
+			}
+			
+			value = data.substr(pos + 1, quote - pos - 1);
+			pos = quote + 1;
+		}
+		else
+		{
+			std::size_t comma = data.find(',', pos);
+			if (comma == StringRef::npos)
+			{
+				comma = data.size();
+			}
+			
+			value = trim(data.substr(pos, comma - pos));
+			pos = comma;
+		}
+		
+		if (key.empty())
+		{
+			return false;
+		}
+		
+		if (_paramsCount == MAX_PARAMS)
+		{
+			return false;
+		}
+		
+		Param& param = _params[_paramsCount++];
+		param.key = key;
+		param.value = value;
+	}
+	
+	return true;
+}
+
+StringRef DigestParams::get(StringRef key) const
+{
+	for (std::size_t i = 0; i < _paramsCount; i++)
+	{
+		if (_params[i].key.iequals(key))
+		{
+			return _params[i].value;
+		}
+	}
+	
+	return StringRef();
+}
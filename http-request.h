@@ -0,0 +1,166 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+
+// Non-owning reference to the characters (std::string_view is not
+// available in C++14). The referred buffer should outlive the reference.
+class StringRef final
+{
+public:
+	static const std::size_t npos = static_cast<std::size_t>(-1);
+	
+public:
+	StringRef() = default;
+	
+	StringRef(const char* data, std::size_t size)
+		: _data(data)
+		, _size(size)
+	{
+	}
+	
+	StringRef(const char* s)
+		: _data(s)
+		, _size(std::strlen(s))
+	{
+	}
+	
+	StringRef(const std::string& s)
+		: _data(s.data())
+		, _size(s.size())
+	{
+	}
+	
+	const char* data() const
+	{
+		return _data;
+	}
+	
+	std::size_t size() const
+	{
+		return _size;
+	}
+	
+	bool empty() const
+	{
+		return _size == 0;
+	}
+	
+	char operator[](std::size_t i) const
+	{
+		return _data[i];
+	}
+	
+	StringRef substr(std::size_t pos, std::size_t count = npos) const
+	{
+		pos = pos < _size ? pos : _size;
+		return StringRef(_data + pos, count < _size - pos ? count : _size - pos);
+	}
+	
+	std::size_t find(char c, std::size_t pos = 0) const;
+	
+	bool equals(StringRef other) const
+	{
+		return _size == other._size && std::memcmp(_data, other._data, _size) == 0;
+	}
+	
+	// ASCII case-insensitive comparison
+	bool iequals(StringRef other) const;
+	
+	std::string str() const
+	{
+		return std::string(_data, _size);
+	}
+	
+private:
+	const char* _data = "";
+	std::size_t _size = 0;
+};
+
+
+// for unordered containers keyed by StringRef
+struct StringRefHash
+{
+	std::size_t operator()(StringRef s) const;
+};
+
+struct StringRefEqual
+{
+	bool operator()(StringRef a, StringRef b) const
+	{
+		return a.equals(b);
+	}
+};
+
+
+// Single pass parser of the HTTP request head (request line and headers).
+// The parsed values refer to the request buffer, nothing is allocated.
+class HttpRequest final
+{
+public:
+	static const std::size_t MAX_HEADERS = 32;
+	
+public:
+	// return false if the request is malformed or has too many headers
+	bool parse(StringRef request);
+	
+	StringRef method() const
+	{
+		return _method;
+	}
+	
+	StringRef url() const
+	{
+		return _url;
+	}
+	
+	StringRef version() const
+	{
+		return _version;
+	}
+	
+	// case-insensitive lookup, empty if there is no such header
+	StringRef header(StringRef name) const;
+	
+private:
+	struct Header
+	{
+		StringRef name;
+		StringRef value;
+	};
+	
+	StringRef _method;
+	StringRef _url;
+	StringRef _version;
+	std::array<Header, MAX_HEADERS> _headers;
+	std::size_t _headersCount = 0;
+};
+
+
+// The parameters of 'Authorization: Digest ...' header, they refer
+// to the header value. Quoted values are unquoted (no escapes expected).
+class DigestParams final
+{
+public:
+	static const std::size_t MAX_PARAMS = 16;
+	
+public:
+	// the header value without the scheme. return false if it's malformed.
+	bool parse(StringRef data);
+	
+	// case-insensitive lookup of the key, empty if there is no such parameter
+	StringRef get(StringRef key) const;
+	
+private:
+	struct Param
+	{
+		StringRef key;
+		StringRef value;
+	};
+	
+	std::array<Param, MAX_PARAMS> _params;
+	std::size_t _paramsCount = 0;
+};
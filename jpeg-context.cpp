@@ -0,0 +1,65 @@
+#include "jpeg-context.h"
+
+#ifdef HAVE_LIBJPEG
+
+#include <algorithm>
+
+
+JpegContext::JpegContext()
+{
+	jpeg_std_error(&errorManager);
+	errorManager.error_exit = errorExit;
+	errorManager.output_message = outputMessage;
+	
+	destination.init_destination = initDestination;
+	destination.empty_output_buffer = emptyOutputBuffer;
+	destination.term_destination = termDestination;
+}
+
+void JpegContext::attach(j_common_ptr info)
+{
+	info->err = &errorManager;
+	info->client_data = this;
+}
+
+void JpegContext::attachDestination(j_compress_ptr cinfo)
+{
+	cinfo->dest = &destination;
+}
+
+void JpegContext::errorExit(j_common_ptr info)
+{
+	JpegContext& context = of(info);
+	(*info->err->format_message)(info, context.message);
+	std::longjmp(context.jump, 1);
+}
+
+void JpegContext::outputMessage(j_common_ptr)
+{
+}
+
+void JpegContext::initDestination(j_compress_ptr cinfo)
+{
+	JpegContext& context = of(reinterpret_cast<j_common_ptr>(cinfo));
+	context.output.resize(std::max(context.output.capacity(), context.initialSize));
+	cinfo->dest->next_output_byte = context.output.data();
+	cinfo->dest->free_in_buffer = context.output.size();
+}
+
+boolean JpegContext::emptyOutputBuffer(j_compress_ptr cinfo)
+{
+	JpegContext& context = of(reinterpret_cast<j_common_ptr>(cinfo));
+	const std::size_t size = context.output.size();
+	context.output.resize(size * 2);
+	cinfo->dest->next_output_byte = context.output.data() + size;
+	cinfo->dest->free_in_buffer = size;
+	return TRUE;
+}
+
+void JpegContext::termDestination(j_compress_ptr cinfo)
+{
+	JpegContext& context = of(reinterpret_cast<j_common_ptr>(cinfo));
+	context.output.resize(context.output.size() - cinfo->dest->free_in_buffer);
+}
+
+#endif
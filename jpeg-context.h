@@ -0,0 +1,53 @@
+#pragma once
+
+#ifdef HAVE_LIBJPEG
+
+#include <csetjmp>
+#include <cstddef>
+#include <cstdio>
+#include <vector>
+
+#include <jpeglib.h>
+
+
+// The error handling and the memory destination of libjpeg, shared by 
+// the encoder and the transcoder. The errors jump back to the caller's
+// setjmp(jump) with the message, libjpeg must not exit. The image is 
+// written to the recycled storage (output), it grows when it's full.
+struct JpegContext
+{
+	struct jpeg_error_mgr errorManager;
+	struct jpeg_destination_mgr destination;
+	std::jmp_buf jump;
+	char message[JMSG_LENGTH_MAX] = { 0 };
+	
+	std::vector<unsigned char> output;
+	std::size_t initialSize = 0;
+	
+	JpegContext();
+	
+	// the errors of the compressor or decompressor are handled by the context
+	void attach(j_common_ptr info);
+	// the compressor writes to output
+	void attachDestination(j_compress_ptr cinfo);
+	
+	// the initial size of output, about 2 bits per pixel
+	void estimateSize(unsigned width, unsigned height)
+	{
+		initialSize = static_cast<std::size_t>(width) * height / 4 + 4096;
+	}
+	
+	static JpegContext& of(j_common_ptr info)
+	{
+		return *static_cast<JpegContext*>(info->client_data);
+	}
+	
+private:
+	static void errorExit(j_common_ptr info);
+	static void outputMessage(j_common_ptr info);
+	static void initDestination(j_compress_ptr cinfo);
+	static boolean emptyOutputBuffer(j_compress_ptr cinfo);
+	static void termDestination(j_compress_ptr cinfo);
+};
+
+#endif
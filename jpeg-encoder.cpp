@@ -0,0 +1,332 @@
+#include "jpeg-encoder.h"
+#include "jpeg-context.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define JPEG_ENCODER_NEON
+#include <arm_neon.h>
+#endif
+
+
+const int JpegEncoder::DEFAULT_QUALITY = 80;
+
+
+namespace
+{
+
+// the YUYV row to the rows of Y, Cb and Cr
+void splitYuyv(const unsigned char* src, unsigned char* y, unsigned char* cb, unsigned char* cr,
+			unsigned width)
+{
+	unsigned x = 0;
+
+#if defined(__SSE2__)
+	const __m128i lowBytes = _mm_set1_epi16(0x00FF);
+	for (; x + 16 <= width; x += 16)
+	{
+		const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * x));
+		const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * x + 16));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(y + x),
+			_mm_packus_epi16(_mm_and_si128(a, lowBytes), _mm_and_si128(b, lowBytes)));
+		
+		// Cb Cr Cb Cr ...
+		const __m128i c = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(cb + x / 2),
+			_mm_packus_epi16(_mm_and_si128(c, lowBytes), _mm_setzero_si128()));
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(cr + x / 2),
+			_mm_packus_epi16(_mm_srli_epi16(c, 8), _mm_setzero_si128()));
+	}
+#elif defined(JPEG_ENCODER_NEON)
+	for (; x + 16 <= width; x += 16)
+	{
+		// Y0 Cb Y1 Cr
+		const uint8x8x4_t p = vld4_u8(src + 2 * x);
+		uint8x8x2_t luma;
+		luma.val[0] = p.val[0];
+		luma.val[1] = p.val[2];
+		vst2_u8(y + x, luma);
+		vst1_u8(cb + x / 2, p.val[1]);
+		vst1_u8(cr + x / 2, p.val[3]);
+	}
+#endif
+	
+	for (; x + 2 <= width; x += 2)
+	{
+		y[x] = src[2 * x];
+		cb[x / 2] = src[2 * x + 1];
+		y[x + 1] = src[2 * x + 2];
+		cr[x / 2] = src[2 * x + 3];
+	}
+}
+
+// the interleaved CbCr row of NV12 to the rows of Cb and Cr
+void splitCbCr(const unsigned char* src, unsigned char* cb, unsigned char* cr, unsigned count)
+{
+	unsigned x = 0;
+
+#if defined(__SSE2__)
+	const __m128i lowBytes = _mm_set1_epi16(0x00FF);
+	for (; x + 16 <= count; x += 16)
+	{
+		const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * x));
+		const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * x + 16));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(cb + x),
+			_mm_packus_epi16(_mm_and_si128(a, lowBytes), _mm_and_si128(b, lowBytes)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(cr + x),
+			_mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+	}
+#elif defined(JPEG_ENCODER_NEON)
+	for (; x + 16 <= count; x += 16)
+	{
+		const uint8x16x2_t p = vld2q_u8(src + 2 * x);
+		vst1q_u8(cb + x, p.val[0]);
+		vst1q_u8(cr + x, p.val[1]);
+	}
+#endif
+	
+	for (; x < count; x++)
+	{
+		cb[x] = src[2 * x];
+		cr[x] = src[2 * x + 1];
+	}
+}
+
+// repeat the last sample up to the MCU boundary
+void padRow(unsigned char* row, unsigned width, std::size_t stride)
+{
+	if (stride > width)
+	{
+		memset(row + width, row[width - 1], stride - width);
+	}
+}
+
+}
+
+
+#ifdef HAVE_LIBJPEG
+
+// the errors of libjpeg jump back to compress()
+struct JpegEncoder::Context : JpegContext
+{
+	struct jpeg_compress_struct cinfo;
+};
+
+#else
+
+struct JpegEncoder::Context
+{
+	char message[1] = { 0 };
+};
+
+#endif
+
+
+JpegEncoder::JpegEncoder(const Settings& settings)
+	: _settings(settings)
+{
+#ifndef HAVE_LIBJPEG
+	throw std::runtime_error("JPEG encoding is not available, the server is built without libjpeg.");
+#else
+	if (_settings.width == 0 || _settings.height == 0 || _settings.width % 2 != 0)
+	{
+		throw std::invalid_argument("Invalid raw frame size.");
+	}
+	
+	const bool nv12 = _settings.format == RawFormat::NV12;
+	if (_settings.bytesPerLine == 0)
+	{
+		_settings.bytesPerLine = nv12 ? _settings.width : _settings.width * 2;
+	}
+	
+	_context.reset(new Context());
+	Context& c = *_context;
+	c.attach(reinterpret_cast<j_common_ptr>(&c.cinfo));
+	
+	if (setjmp(c.jump))
+	{
+		const std::string message(c.message);
+		jpeg_destroy_compress(&c.cinfo);
+		_context.reset();
+		throw std::runtime_error("Could not set up JPEG encoder: " + message);
+	}
+	
+	jpeg_create_compress(&c.cinfo);
+	c.attachDestination(&c.cinfo);
+	
+	c.cinfo.image_width = _settings.width;
+	c.cinfo.image_height = _settings.height;
+	c.cinfo.input_components = 3;
+	c.cinfo.in_color_space = JCS_YCbCr;
+	jpeg_set_defaults(&c.cinfo);
+	jpeg_set_quality(&c.cinfo, _settings.quality, TRUE);
+	
+	// the planes are passed downsampled already
+	const unsigned lumaV = nv12 ? 2 : 1;
+	c.cinfo.raw_data_in = TRUE;
+	c.cinfo.comp_info[0].h_samp_factor = 2;
+	c.cinfo.comp_info[0].v_samp_factor = lumaV;
+	for (int i = 1; i < 3; i++)
+	{
+		c.cinfo.comp_info[i].h_samp_factor = 1;
+		c.cinfo.comp_info[i].v_samp_factor = 1;
+	}
+	
+	c.estimateSize(_settings.width, _settings.height);
+	
+	const unsigned mcuHeight = 8 * lumaV;
+	const unsigned paddedWidth = (_settings.width + 15) / 16 * 16;
+	const unsigned paddedHeight = (_settings.height + mcuHeight - 1) / mcuHeight * mcuHeight;
+	_chromaRows = nv12 ? (_settings.height + 1) / 2 : _settings.height;
+	_directLuma = nv12 && paddedWidth == _settings.width;
+	
+	const unsigned rows[3] = { _settings.height, _chromaRows, _chromaRows };
+	for (int i = 0; i < 3; i++)
+	{
+		_strides[i] = i == 0 ? paddedWidth : paddedWidth / 2;
+		if (i != 0 || !_directLuma)
+		{
+			_planes[i].resize(_strides[i] * rows[i]);
+		}
+		
+		_rows[i].resize(i == 0 ? paddedHeight : paddedHeight / lumaV);
+		for (std::size_t r = 0; r < _rows[i].size(); r++)
+		{
+			_rows[i][r] = _planes[i].data() + _strides[i] * std::min<std::size_t>(r, rows[i] - 1);
+		}
+	}
+#endif
+}
+
+JpegEncoder::~JpegEncoder()
+{
+#ifdef HAVE_LIBJPEG
+	if (_context)
+	{
+		jpeg_destroy_compress(&_context->cinfo);
+	}
+#endif
+}
+
+std::shared_ptr<Frame> JpegEncoder::encode(const Frame& raw)
+{
+	const std::size_t expectedSize = _settings.format == RawFormat::NV12
+		? _settings.bytesPerLine * (_settings.height + _chromaRows)
+		: _settings.bytesPerLine * _settings.height;
+	if (raw.size() < expectedSize)
+	{
+		throw std::runtime_error("The raw frame is truncated.");
+	}
+	
+	splitPlanes(raw.data());
+
+#ifdef HAVE_LIBJPEG
+	_context->output = _framePool.takeStorage();
+#endif
+	
+	if (!compress())
+	{
+		throw std::runtime_error(std::string("Could not encode JPEG image: ") + _context->message);
+	}
+	
+	std::shared_ptr<Frame> frame;
+#ifdef HAVE_LIBJPEG
+	frame = _framePool.makeFrame(std::move(_context->output));
+#endif
+	
+	if (raw.hasCaptureSequence())
+	{
+		frame->setCaptureInfo(raw.capturedAt(), raw.captureSequence());
+	}
+	
+	return frame;
+}
+
+void JpegEncoder::splitPlanes(const unsigned char* data)
+{
+	const unsigned width = _settings.width;
+	const std::size_t stride = _settings.bytesPerLine;
+	
+	if (_settings.format == RawFormat::YUYV)
+	{
+		for (unsigned r = 0; r < _settings.height; r++)
+		{
+			unsigned char* y = _planes[0].data() + _strides[0] * r;
+			unsigned char* cb = _planes[1].data() + _strides[1] * r;
+			unsigned char* cr = _planes[2].data() + _strides[2] * r;
+			splitYuyv(data + stride * r, y, cb, cr, width);
+			padRow(y, width, _strides[0]);
+			padRow(cb, width / 2, _strides[1]);
+			padRow(cr, width / 2, _strides[2]);
+		}
+		return;
+	}
+	
+	if (_directLuma)
+	{
+		// libjpeg does not write to the rows, they are not const for its API only
+		for (std::size_t r = 0; r < _rows[0].size(); r++)
+		{
+			_rows[0][r] = const_cast<unsigned char*>(data)
+				+ stride * std::min<std::size_t>(r, _settings.height - 1);
+		}
+	}
+	else
+	{
+		for (unsigned r = 0; r < _settings.height; r++)
+		{
+			unsigned char* y = _planes[0].data() + _strides[0] * r;
+			memcpy(y, data + stride * r, width);
+			padRow(y, width, _strides[0]);
+		}
+	}
+	
+	const unsigned char* chroma = data + stride * _settings.height;
+	for (unsigned r = 0; r < _chromaRows; r++)
+	{
+		unsigned char* cb = _planes[1].data() + _strides[1] * r;
+		unsigned char* cr = _planes[2].data() + _strides[2] * r;
+		splitCbCr(chroma + stride * r, cb, cr, width / 2);
+		padRow(cb, width / 2, _strides[1]);
+		padRow(cr, width / 2, _strides[2]);
+	}
+}
+
+bool JpegEncoder::compress()
+{
+#ifdef HAVE_LIBJPEG
+	Context& c = *_context;
+	
+	if (setjmp(c.jump))
+	{
+		jpeg_abort_compress(&c.cinfo);
+		c.output.clear();
+		return false;
+	}
+	
+	jpeg_start_compress(&c.cinfo, TRUE);
+	
+	// the whole MCU rows, Cb and Cr have the rows of every lumaV-th Y row
+	const unsigned lumaV = c.cinfo.comp_info[0].v_samp_factor;
+	const unsigned lines = c.cinfo.max_v_samp_factor * DCTSIZE;
+	JSAMPARRAY planes[3];
+	while (c.cinfo.next_scanline < c.cinfo.image_height)
+	{
+		const unsigned row = c.cinfo.next_scanline;
+		planes[0] = &_rows[0][row];
+		planes[1] = &_rows[1][row / lumaV];
+		planes[2] = &_rows[2][row / lumaV];
+		jpeg_write_raw_data(&c.cinfo, planes, lines);
+	}
+	
+	jpeg_finish_compress(&c.cinfo);
+	return true;
+#else
+	return false;
+#endif
+}
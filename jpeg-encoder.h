@@ -0,0 +1,65 @@
+#pragma once
+
+#include "frame.h"
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+
+// Encodes the raw YUV frames to JPEG with libjpeg (libjpeg-turbo does
+// the DCT and the entropy coding with SIMD). The frames are YCbCr already,
+// so they are only split to planes and passed as raw data, without
+// the colour conversion and downsampling of libjpeg. The encoder is used
+// by a single thread. If the server is built without libjpeg, the
+// constructor throws.
+class JpegEncoder final
+{
+public:
+	static const int DEFAULT_QUALITY;
+	
+	enum class RawFormat
+	{
+		YUYV,	// packed 4:2:2
+		NV12	// Y plane followed by interleaved CbCr plane, 4:2:0
+	};
+	
+	struct Settings
+	{
+		RawFormat format = RawFormat::YUYV;
+		unsigned width = 0;
+		unsigned height = 0;
+		unsigned bytesPerLine = 0;	// of the Y plane, 0 - no padding
+		int quality = DEFAULT_QUALITY;
+	};
+	
+public:
+	JpegEncoder(const JpegEncoder&) = delete;
+	JpegEncoder& operator=(const JpegEncoder&) = delete;
+	
+	explicit JpegEncoder(const Settings& settings);
+	~JpegEncoder();
+	
+	// the image keeps the capture time and sequence of the raw frame
+	std::shared_ptr<Frame> encode(const Frame& raw);
+	
+private:
+	struct Context;
+	
+	void splitPlanes(const unsigned char* data);
+	// return false on libjpeg error, see Context::message
+	bool compress();
+	
+private:
+	Settings _settings;
+	std::unique_ptr<Context> _context;
+	FramePool _framePool;
+	
+	// the planes padded to the whole MCUs, the rows past
+	// the image height refer to the last row
+	std::vector<unsigned char> _planes[3];
+	std::vector<unsigned char*> _rows[3];
+	std::size_t _strides[3] = { 0, 0, 0 };
+	unsigned _chromaRows = 0;	// of the image, not padded
+	bool _directLuma = false;	// the rows of Y refer to the NV12 frame
+};
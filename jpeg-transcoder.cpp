@@ -0,0 +1,232 @@
+#include "jpeg-transcoder.h"
+#include "jpeg-context.h"
+#include "jpeg-encoder.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#ifdef HAVE_LIBJPEG
+#include <jerror.h>
+#endif
+
+
+const unsigned JpegTranscoder::MAX_TIER_WIDTH = 16384;
+
+
+#ifdef HAVE_LIBJPEG
+
+// the errors of libjpeg jump back to decompress() or compress()
+struct JpegTranscoder::Context : JpegContext
+{
+	struct jpeg_decompress_struct dinfo;
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_source_mgr source;
+	
+	// the frame is in memory as a whole, the source is set by decompress()
+	static void initSource(j_decompress_ptr)
+	{
+	}
+	
+	static boolean fillInputBuffer(j_decompress_ptr cinfo)
+	{
+		// the frame is truncated, the rest of the image is decoded as gray
+		static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+		WARNMS(cinfo, JWRN_JPEG_EOF);
+		cinfo->src->next_input_byte = eoi;
+		cinfo->src->bytes_in_buffer = sizeof(eoi);
+		return TRUE;
+	}
+	
+	static void skipInputData(j_decompress_ptr cinfo, long count)
+	{
+		if (count > 0)
+		{
+			const std::size_t n = std::min<std::size_t>(count, cinfo->src->bytes_in_buffer);
+			cinfo->src->next_input_byte += n;
+			cinfo->src->bytes_in_buffer -= n;
+		}
+	}
+	
+	static void termSource(j_decompress_ptr)
+	{
+	}
+};
+
+#else
+
+struct JpegTranscoder::Context
+{
+	char message[1] = { 0 };
+};
+
+#endif
+
+
+JpegTranscoder::JpegTranscoder()
+{
+#ifndef HAVE_LIBJPEG
+	throw std::runtime_error("JPEG transcoding is not available, the server is built without libjpeg.");
+#else
+	_context.reset(new Context());
+	Context& c = *_context;
+	c.attach(reinterpret_cast<j_common_ptr>(&c.dinfo));
+	c.attach(reinterpret_cast<j_common_ptr>(&c.cinfo));
+	
+	// the decompressor is created first, it's destroyed by the jump
+	volatile bool decompressCreated = false;
+	if (setjmp(c.jump))
+	{
+		const std::string message(c.message);
+		if (decompressCreated)
+		{
+			jpeg_destroy_decompress(&c.dinfo);
+		}
+		_context.reset();
+		throw std::runtime_error("Could not set up JPEG transcoder: " + message);
+	}
+	
+	jpeg_create_decompress(&c.dinfo);
+	decompressCreated = true;
+	jpeg_create_compress(&c.cinfo);
+	
+	c.source.init_source = Context::initSource;
+	c.source.fill_input_buffer = Context::fillInputBuffer;
+	c.source.skip_input_data = Context::skipInputData;
+	c.source.resync_to_restart = jpeg_resync_to_restart;
+	c.source.term_source = Context::termSource;
+	c.dinfo.src = &c.source;
+	c.attachDestination(&c.cinfo);
+#endif
+}
+
+JpegTranscoder::~JpegTranscoder()
+{
+#ifdef HAVE_LIBJPEG
+	if (_context)
+	{
+		jpeg_destroy_compress(&_context->cinfo);
+		jpeg_destroy_decompress(&_context->dinfo);
+	}
+#endif
+}
+
+std::shared_ptr<Frame> JpegTranscoder::transcode(const Frame& jpeg, const Tier& tier)
+{
+	if (!decompress(jpeg, tier.width))
+	{
+		throw std::runtime_error(std::string("Could not decode JPEG image: ") + _context->message);
+	}
+
+#ifdef HAVE_LIBJPEG
+	_context->output = _framePool.takeStorage();
+#endif
+	
+	if (!compress(tier.quality != 0 ? tier.quality : JpegEncoder::DEFAULT_QUALITY))
+	{
+		throw std::runtime_error(std::string("Could not encode JPEG image: ") + _context->message);
+	}
+	
+	std::shared_ptr<Frame> frame;
+#ifdef HAVE_LIBJPEG
+	frame = _framePool.makeFrame(std::move(_context->output));
+#endif
+	
+	frame->setCaptureInfo(jpeg);
+	return frame;
+}
+
+bool JpegTranscoder::decompress(const Frame& jpeg, unsigned width)
+{
+#ifdef HAVE_LIBJPEG
+	Context& c = *_context;
+	
+	if (setjmp(c.jump))
+	{
+		jpeg_abort_decompress(&c.dinfo);
+		return false;
+	}
+	
+	c.source.next_input_byte = jpeg.data();
+	c.source.bytes_in_buffer = jpeg.size();
+	jpeg_read_header(&c.dinfo, TRUE);
+	
+	// the largest M/8 within the width, libjpeg without
+	// the scaled DCT (before 7) rounds it to 1/2^N
+	unsigned scale = 8;
+	while (width != 0 && scale > 1 && (c.dinfo.image_width * scale + 7) / 8 > width)
+	{
+		scale--;
+	}
+	c.dinfo.scale_num = scale;
+	c.dinfo.scale_denom = 8;
+	
+	// the chroma is downsampled again by the encoder, so upsampling
+	// it smoothly is the waste of time
+	if (c.dinfo.jpeg_color_space == JCS_YCbCr)
+	{
+		c.dinfo.out_color_space = JCS_YCbCr;
+	}
+	c.dinfo.do_fancy_upsampling = FALSE;
+	c.dinfo.dct_method = JDCT_IFAST;
+	
+	jpeg_start_decompress(&c.dinfo);
+	
+	const std::size_t stride = static_cast<std::size_t>(c.dinfo.output_width) * c.dinfo.output_components;
+	_image.resize(stride * c.dinfo.output_height);
+	_rows.resize(c.dinfo.output_height);
+	for (std::size_t r = 0; r < _rows.size(); r++)
+	{
+		_rows[r] = _image.data() + stride * r;
+	}
+	
+	while (c.dinfo.output_scanline < c.dinfo.output_height)
+	{
+		jpeg_read_scanlines(&c.dinfo, &_rows[c.dinfo.output_scanline],
+							c.dinfo.output_height - c.dinfo.output_scanline);
+	}
+	
+	jpeg_finish_decompress(&c.dinfo);
+	return true;
+#else
+	(void)jpeg;
+	(void)width;
+	return false;
+#endif
+}
+
+bool JpegTranscoder::compress(int quality)
+{
+#ifdef HAVE_LIBJPEG
+	Context& c = *_context;
+	
+	if (setjmp(c.jump))
+	{
+		jpeg_abort_compress(&c.cinfo);
+		c.output.clear();
+		return false;
+	}
+	
+	c.cinfo.image_width = c.dinfo.output_width;
+	c.cinfo.image_height = c.dinfo.output_height;
+	c.cinfo.input_components = c.dinfo.output_components;
+	c.cinfo.in_color_space = c.dinfo.out_color_space;
+	jpeg_set_defaults(&c.cinfo);
+	jpeg_set_quality(&c.cinfo, quality, TRUE);
+	
+	c.estimateSize(c.cinfo.image_width, c.cinfo.image_height);
+	
+	jpeg_start_compress(&c.cinfo, TRUE);
+	while (c.cinfo.next_scanline < c.cinfo.image_height)
+	{
+		jpeg_write_scanlines(&c.cinfo, &_rows[c.cinfo.next_scanline],
+							c.cinfo.image_height - c.cinfo.next_scanline);
+	}
+	
+	jpeg_finish_compress(&c.cinfo);
+	return true;
+#else
+	(void)quality;
+	return false;
+#endif
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "frame.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+
+// Transcodes the JPEG frames to a smaller size and/or lower quality.
+// The image is decoded already downscaled (libjpeg scales by M/8 in
+// the inverse DCT, so the smaller the size, the cheaper the decoding)
+// and encoded again. The colours stay YCbCr, they are not converted.
+// The transcoder is used by a single thread. If the server is built
+// without libjpeg, the constructor throws.
+class JpegTranscoder final
+{
+public:
+	// the frame is scaled down to the largest size not wider than the width,
+	// the scale is 1/8 at least
+	struct Tier
+	{
+		unsigned width = 0;	// 0 - the width of the source
+		int quality = 0;	// 0 - JpegEncoder::DEFAULT_QUALITY
+		
+		// nothing to transcode
+		bool original() const
+		{
+			return width == 0 && quality == 0;
+		}
+		
+		// the key of the transcoded frames in the frame variants
+		std::uint32_t key() const
+		{
+			return static_cast<std::uint32_t>(width) << 8 | static_cast<std::uint32_t>(quality);
+		}
+	};
+	
+	// the width is limited, so the tier fits the key
+	static const unsigned MAX_TIER_WIDTH;
+	
+public:
+	JpegTranscoder(const JpegTranscoder&) = delete;
+	JpegTranscoder& operator=(const JpegTranscoder&) = delete;
+	
+	JpegTranscoder();
+	~JpegTranscoder();
+	
+	// the image keeps the capture time and sequence of the source
+	std::shared_ptr<Frame> transcode(const Frame& jpeg, const Tier& tier);
+	
+private:
+	struct Context;
+	
+	// return false on libjpeg error, see Context::message
+	bool decompress(const Frame& jpeg, unsigned width);
+	bool compress(int quality);
+	
+private:
+	std::unique_ptr<Context> _context;
+	FramePool _framePool;
+	
+	// the decoded image, the rows are interleaved components
+	std::vector<unsigned char> _image;
+	std::vector<unsigned char*> _rows;
+};
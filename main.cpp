@@ -2,20 +2,28 @@
 #include <cstring>
 #include <cstdlib>
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <list>
+#include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 
+#include "encoder-pool.h"
 #include "mjpeg-server.h"
+#include "replay-source.h"
 #include "v4l2-camera.h"
 
 #include <getopt.h>
+#include <sys/resource.h>
 
 
-sig_atomic_t needExit = 0;
+volatile sig_atomic_t needExit = 0;
 
 static void sighandler(int signum)
 {
@@ -28,11 +36,31 @@ static void sighandler(int signum)
 
 int main(int argc, char* argv[])
 {
-	const char* short_options = "c::h";
+	const char* short_options = "c::d:r:R:W:H:F:P:B:b:o:e:q:T:s:zt:m:i:pfh";
 	
 	const struct option long_options[] = 
 	{
 		{ "credentials", required_argument, NULL, 'c' },
+		{ "device", required_argument, NULL, 'd' },
+		{ "replay", required_argument, NULL, 'r' },
+		{ "replay-fps", required_argument, NULL, 'R' },
+		{ "width", required_argument, NULL, 'W' },
+		{ "height", required_argument, NULL, 'H' },
+		{ "format", required_argument, NULL, 'F' },
+		{ "fps", required_argument, NULL, 'P' },
+		{ "bandwidth", required_argument, NULL, 'B' },
+		{ "buffers", required_argument, NULL, 'b' },
+		{ "io-method", required_argument, NULL, 'o' },
+		{ "encoders", required_argument, NULL, 'e' },
+		{ "quality", required_argument, NULL, 'q' },
+		{ "transcoders", required_argument, NULL, 'T' },
+		{ "slow-clients", required_argument, NULL, 's' },
+		{ "zerocopy", no_argument, NULL, 'z' },
+		{ "senders", required_argument, NULL, 't' },
+		{ "max-clients", required_argument, NULL, 'm' },
+		{ "max-clients-per-ip", required_argument, NULL, 'i' },
+		{ "public-metrics", no_argument, NULL, 'p' },
+		{ "frame-headers", no_argument, NULL, 'f' },
 		{ "help", no_argument, NULL, 'h' },
 		{ NULL, 0, NULL, 0 }
 	};
@@ -41,12 +69,50 @@ int main(int argc, char* argv[])
 		[argv]()
 		{
 			std::cout << "usage: " << argv[0] 
-				<< " --credentials <path-to-file> " << std::endl;
+				<< " --credentials <path-to-file> "
+				<< " [--device <video-device> ...] "
+				<< " [--replay <mjpeg-file-or-jpeg-directory> ...] "
+				<< " [--replay-fps <fps, 0 - max>] "
+				<< " [--width <pixels>] "
+				<< " [--height <pixels>] "
+				<< " [--format <fourcc>] "
+				<< " [--fps <frames-per-second>] "
+				<< " [--bandwidth <Mbit/s, select the fastest mode within>] "
+				<< " [--buffers <number-of-capture-buffers, 2 x encoders + 2 for YUYV and NV12 by default>] "
+				<< " [--io-method <mmap|userptr|dmabuf>] "
+				<< " [--encoders <number-of-encoding-threads for YUYV and NV12, at most buffers - 2 frames are queued and encoded>] "
+				<< " [--quality <JPEG quality, 1-100>] "
+				<< " [--transcoders <number-of-threads transcoding to ?width=&q= tiers, 0 - off>] "
+				<< " [--slow-clients <skip|disconnect>] "
+				<< " [--zerocopy] "
+				<< " [--senders <number-of-sending-threads>] "
+				<< " [--max-clients <number-of-clients>] "
+				<< " [--max-clients-per-ip <number-of-clients>] "
+				<< " [--public-metrics] "
+				<< " [--frame-headers] " << std::endl;
 		};
 	
 	int rez = -1;
 	
 	std::string credentialsPath;
+	std::vector<std::string> deviceNames;
+	std::vector<std::string> replayPaths;
+	double replayFps = -1;	// as recorded
+	V4L2Camera::CaptureMode captureMode;
+	double bandwidth = 0;	// Mbit/s, the mode is not selected
+	unsigned buffersCount = V4L2Camera::DEFAULT_BUFFERS_COUNT;
+	bool buffersCountSet = false;
+	V4L2Camera::IoMethod ioMethod = V4L2Camera::IoMethod::Mmap;
+	std::size_t encodersCount = std::max(std::thread::hardware_concurrency(), 1u);
+	int jpegQuality = JpegEncoder::DEFAULT_QUALITY;
+	std::size_t transcodersCount = MJPEGServer::DEFAULT_TRANSCODERS_COUNT;
+	MJPEGServer::SlowClientPolicy slowClientPolicy = MJPEGServer::SlowClientPolicy::SkipFrames;
+	bool zeroCopy = false;
+	std::size_t sendersCount = std::max(std::thread::hardware_concurrency(), 1u);
+	std::size_t maxClients = MJPEGServer::DEFAULT_MAX_CLIENTS;
+	std::size_t maxClientsPerAddress = 0;
+	bool publicMetrics = false;
+	bool frameHeaders = false;
 	while ((rez = getopt_long_only(argc, argv, short_options, long_options, NULL)) != -1)
 	{
 		switch (rez)
@@ -55,6 +121,147 @@ int main(int argc, char* argv[])
 			credentialsPath = optarg;
 			break;
 			
+		case 'd':
+			deviceNames.push_back(optarg);
+			break;
+			
+		case 'r':
+			replayPaths.push_back(optarg);
+			break;
+			
+		case 'R':
+			replayFps = std::strtod(optarg, NULL);
+			break;
+			
+		case 'W':
+			captureMode.width = std::strtoul(optarg, NULL, 10);
+			break;
+			
+		case 'H':
+			captureMode.height = std::strtoul(optarg, NULL, 10);
+			break;
+			
+		case 'F':
+			captureMode.pixelFormat = V4L2Camera::pixelFormat(optarg);
+			if (captureMode.pixelFormat == 0)
+			{
+				std::cerr << "Malformed pixel format '" << optarg << "'" << std::endl;
+				std::exit(EXIT_FAILURE);
+			}
+			break;
+			
+		case 'P':
+			captureMode.setFps(std::strtod(optarg, NULL));
+			break;
+			
+		case 'B':
+			bandwidth = std::strtod(optarg, NULL);
+			if (bandwidth <= 0)
+			{
+				std::cerr << "The bandwidth should be positive." << std::endl;
+				std::exit(EXIT_FAILURE);
+			}
+			break;
+			
+		case 'b':
+			buffersCount = std::strtoul(optarg, NULL, 10);
+			if (buffersCount == 0)
+			{
+				std::cerr << "The number of capture buffers should be positive." << std::endl;
+				std::exit(EXIT_FAILURE);
+			}
+			buffersCountSet = true;
+			break;
+			
+		case 'o':
+			if (std::strcmp(optarg, "mmap") == 0)
+			{
+				ioMethod = V4L2Camera::IoMethod::Mmap;
+			}
+			else if (std::strcmp(optarg, "userptr") == 0)
+			{
+				ioMethod = V4L2Camera::IoMethod::UserPtr;
+			}
+			else if (std::strcmp(optarg, "dmabuf") == 0)
+			{
+				ioMethod = V4L2Camera::IoMethod::DmaBuf;
+			}
+			else
+			{
+				std::cerr << "Unknown I/O method '" << optarg << "'" << std::endl;
+				usage();
+				std::exit(EXIT_FAILURE);
+			}
+			break;
+			
+		case 'e':
+			encodersCount = std::strtoul(optarg, NULL, 10);
+			if (encodersCount == 0)
+			{
+				std::cerr << "The number of encoding threads should be positive." << std::endl;
+				std::exit(EXIT_FAILURE);
+			}
+			break;
+			
+		case 'q':
+			jpegQuality = std::atoi(optarg);
+			if (jpegQuality < 1 || jpegQuality > 100)
+			{
+				std::cerr << "The JPEG quality should be from 1 to 100." << std::endl;
+				std::exit(EXIT_FAILURE);
+			}
+			break;
+			
+		case 'T':
+			transcodersCount = std::strtoul(optarg, NULL, 10);
+			break;
+			
+		case 's':
+			if (std::strcmp(optarg, "skip") == 0)
+			{
+				slowClientPolicy = MJPEGServer::SlowClientPolicy::SkipFrames;
+			}
+			else if (std::strcmp(optarg, "disconnect") == 0)
+			{
+				slowClientPolicy = MJPEGServer::SlowClientPolicy::Disconnect;
+			}
+			else
+			{
+				std::cerr << "Unknown slow clients policy '" << optarg << "'" << std::endl;
+				usage();
+				std::exit(EXIT_FAILURE);
+			}
+			break;
+			
+		case 'z':
+			zeroCopy = true;
+			break;
+			
+		case 't':
+			sendersCount = std::strtoul(optarg, NULL, 10);
+			if (sendersCount == 0)
+			{
+				std::cerr << "The number of sending threads should be positive." << std::endl;
+				std::exit(EXIT_FAILURE);
+			}
+			break;
+			
+		case 'm':
+			maxClients = std::strtoul(optarg, NULL, 10);
+			break;
+			
+		case 'i':
+			maxClientsPerAddress = std::strtoul(optarg, NULL, 10);
+			break;
+			
+		case 'p':
+			publicMetrics = true;
+			break;
+			
+		case 'f':
+			frameHeaders = true;
+			break;
+			
 		case 'h':
 			usage();
 			std::exit(EXIT_SUCCESS);
@@ -75,6 +282,10 @@ int main(int argc, char* argv[])
 		std::exit(EXIT_FAILURE);
 	}
 	
+	if (deviceNames.empty() && replayPaths.empty())
+	{
+		deviceNames.push_back("/dev/video0");
+	}
 		
 	struct sigaction sigact;
 	memset(&sigact, 0, sizeof(sigact));
@@ -93,6 +304,14 @@ int main(int argc, char* argv[])
 	sigaddset(&sigset, SIGPIPE);
 	rc = sigprocmask(SIG_BLOCK, &sigset, NULL);
 	
+	// every client takes a descriptor, the default soft limit (1024) is too low
+	struct rlimit rlim;
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max)
+	{
+		rlim.rlim_cur = rlim.rlim_max;
+		rc = setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+	
 	try
 	{
 		// read credentials		
@@ -115,31 +334,216 @@ int main(int argc, char* argv[])
 			credentials.emplace_back(line);
 		}
 		
-		// setup camera
-		V4L2Camera v4l2Camera;
+		// setup cameras and replays, the source N is streamed at /camN (at / if it's single)
+		std::vector<std::unique_ptr<FrameSource>> sources;
+		std::vector<std::string> sourceNames;
+		std::vector<V4L2Camera::CaptureMode> captureModes;	// of the cameras
+		std::vector<std::size_t> captureBuffers;	// granted by the drivers
+		for (const std::string& deviceName : deviceNames)
+		{
+			std::unique_ptr<V4L2Camera> v4l2Camera(new V4L2Camera());
+			
+			v4l2Camera->openDevice(deviceName.c_str());
+			v4l2Camera->printCapabilities();
+			
+			// the fastest mode within the bandwidth, the fields given are kept
+			V4L2Camera::CaptureMode mode = captureMode;
+			if (bandwidth > 0)
+			{
+				V4L2Camera::CaptureMode requested = captureMode;
+				if (requested.pixelFormat == 0)
+				{
+					requested.pixelFormat = V4L2Camera::pixelFormat("MJPG");
+				}
+				
+				if (!V4L2Camera::selectMode(v4l2Camera->enumerateModes(), requested, bandwidth * 1e6, mode))
+				{
+					throw std::runtime_error("No capture mode of " + deviceName + " fits the bandwidth.");
+				}
+			}
+			
+			v4l2Camera->setupCaptureFormat(mode);
+			
+			// the raw frames wait in the encoder queue referring to the capture buffers, 
+			// and the camera copies the frame when only 2 buffers remain queued. so there
+			// are enough buffers for every encoder and a frame queued for it.
+			const V4L2Camera::CaptureMode& granted = v4l2Camera->captureMode();
+			unsigned buffers = buffersCount;
+			if (!buffersCountSet && granted.pixelFormat != V4L2Camera::pixelFormat("MJPG")
+				&& granted.pixelFormat != V4L2Camera::pixelFormat("JPEG"))
+			{
+				buffers = std::max<unsigned>(buffers, 2 * encodersCount + 2);
+			}
+			
+			v4l2Camera->setupCaptureBuffer(buffers, ioMethod);
+			v4l2Camera->startCapturing();
+			
+			captureModes.push_back(v4l2Camera->captureMode());
+			captureBuffers.push_back(v4l2Camera->buffersCount());
+			sources.push_back(std::move(v4l2Camera));
+			sourceNames.push_back(deviceName);
+		}
 		
-		v4l2Camera.openDevice("/dev/video0");
-		v4l2Camera.printCapabilities();
-		v4l2Camera.setupCaptureFormat();
-		v4l2Camera.setupCaptureBuffer();
+		for (const std::string& replayPath : replayPaths)
+		{
+			std::unique_ptr<ReplaySource> replaySource(new ReplaySource(replayPath));
+			if (replayFps >= 0)
+			{
+				replaySource->setFps(replayFps);
+			}
+			replaySource->startCapturing();
+			
+			std::cout << "Replaying " << replaySource->framesCount() << " frames of " 
+				<< replayPath << std::endl;
+			
+			sources.push_back(std::move(replaySource));
+			sourceNames.push_back(replayPath);
+		}
 						
 		MJPEGServer mjpegServer(8090);
-		mjpegServer.setCredentials(credentials);
+		if (mjpegServer.setCredentials(credentials) != 0)
+		{
+			std::cerr << "Malformed lines in " << credentialsPath << " are skipped." << std::endl;
+		}
+		mjpegServer.setSlowClientPolicy(slowClientPolicy);
+		mjpegServer.setZeroCopy(zeroCopy);
+		mjpegServer.setSendersCount(sendersCount);
+		mjpegServer.setTranscodersCount(transcodersCount);
+		mjpegServer.setMaxClients(maxClients, maxClientsPerAddress);
+		mjpegServer.setPublicMetrics(publicMetrics);
+		mjpegServer.setFrameHeaders(frameHeaders);
+		
+		// the single source keeps the root URL of the former versions
+		for (std::size_t i = 0; i < sources.size(); i++)
+		{
+			mjpegServer.addStream(sources.size() == 1 ? std::string("/") : "/cam" + std::to_string(i));
+		}
+		
+		// the cameras are the first sources
+		for (std::size_t i = 0; i < captureModes.size(); i++)
+		{
+			const V4L2Camera::CaptureMode& mode = captureModes[i];
+			mjpegServer.setCaptureMode(i, mode.format(), mode.width, mode.height, mode.fps());
+		}
+		
+		// the raw frames are encoded by the pool of threads per camera,
+		// the pool publishes them in the capture order
+		std::vector<std::unique_ptr<EncoderPool>> encoderPools(sources.size());
+		for (std::size_t i = 0; i < captureModes.size(); i++)
+		{
+			const V4L2Camera::CaptureMode& mode = captureModes[i];
+			if (mode.pixelFormat == V4L2Camera::pixelFormat("MJPG") 
+				|| mode.pixelFormat == V4L2Camera::pixelFormat("JPEG"))
+			{
+				continue;
+			}
+			
+			JpegEncoder::Settings settings;
+			if (mode.pixelFormat == V4L2Camera::pixelFormat("YUYV"))
+			{
+				settings.format = JpegEncoder::RawFormat::YUYV;
+			}
+			else if (mode.pixelFormat == V4L2Camera::pixelFormat("NV12"))
+			{
+				settings.format = JpegEncoder::RawFormat::NV12;
+			}
+			else
+			{
+				throw std::runtime_error("The capture format " + mode.format() + " of " 
+										+ sourceNames[i] + " is not supported.");
+			}
+			settings.width = mode.width;
+			settings.height = mode.height;
+			settings.bytesPerLine = mode.bytesPerLine;
+			settings.quality = jpegQuality;
+			
+			// the driver may grant fewer buffers than asked, the encoders 
+			// should not hold more than buffers - 2 frames (see above)
+			const std::size_t rawFrames = captureBuffers[i] > 3 ? captureBuffers[i] - 2 : 1;
+			const std::size_t threadsCount = std::min(encodersCount, std::max<std::size_t>(rawFrames - 1, 1));
+			const std::size_t maxQueued = std::max<std::size_t>(rawFrames - threadsCount, 1);
+			
+			MJPEGServer* server = &mjpegServer;
+			encoderPools[i].reset(new EncoderPool(settings, threadsCount, maxQueued, 
+				mjpegServer.outMutex(),
+				[server, i](FramePtr frame)
+				{
+					server->putFrame(i, std::move(frame));
+				}));
+			mjpegServer.setEncoder(i, encoderPools[i].get());
+		}
 		
 		// start server
 		mjpegServer.start();
-
-		while (!needExit)
+		
+		for (std::unique_ptr<EncoderPool>& encoderPool : encoderPools)
 		{
-			std::vector<unsigned char> frame = v4l2Camera.captureFrame();
-			if (!frame.empty())
+			if (encoderPool)
 			{
-				mjpegServer.putFrame(frame);
+				encoderPool->start();
 			}
 		}
 		
+		// every source is captured by own thread
+		std::atomic<bool> captureFailed(false);
+		std::vector<std::thread> captureThreads;
+		for (std::size_t i = 0; i < sources.size(); i++)
+		{
+			captureThreads.emplace_back(
+				[&mjpegServer, &sources, &sourceNames, &encoderPools, &captureFailed, i]()
+				{
+					try
+					{
+						while (!needExit)
+						{
+							FramePtr frame = sources[i]->captureFrame();
+							if (!frame)
+							{
+								continue;
+							}
+							
+							if (encoderPools[i])
+							{
+								encoderPools[i]->submit(std::move(frame));
+							}
+							else
+							{
+								mjpegServer.putFrame(i, std::move(frame));
+							}
+						}
+					}
+					catch (const std::exception& ex)
+					{
+						std::cerr << "Exception (source " << sourceNames[i] << "): " << ex.what() << std::endl;
+						captureFailed = true;
+						needExit = 1;
+					}
+				});
+		}
+		
+		for (std::thread& captureThread : captureThreads)
+		{
+			captureThread.join();
+		}
+		
 		std::cout << "Stopping the server..." << std::endl;
+		
+		// the pools are stopped first, they publish to the server, 
+		// and released after it, the metrics refer to them
+		for (std::unique_ptr<EncoderPool>& encoderPool : encoderPools)
+		{
+			if (encoderPool)
+			{
+				encoderPool->stop();
+			}
+		}
 		mjpegServer.stop();
+		encoderPools.clear();
+		
+		if (captureFailed)
+		{
+			std::exit(EXIT_FAILURE);
+		}
 	}
 	catch (const std::exception& ex)
 	{
@@ -0,0 +1,73 @@
+#include "md5-digest.h"
+
+#include <stdexcept>
+
+#include <openssl/crypto.h>
+
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+
+const std::size_t MD5Digest::HEX_SIZE;
+
+
+MD5Digest::MD5Digest()
+	: _context(EVP_MD_CTX_new())
+{
+	if (_context == nullptr || EVP_DigestInit_ex(_context, EVP_md5(), nullptr) != 1)
+	{
+		EVP_MD_CTX_free(_context);
+		throw std::runtime_error("Could not initialize MD5 digest.");
+	}
+}
+
+MD5Digest::~MD5Digest()
+{
+	EVP_MD_CTX_free(_context);
+}
+
+MD5Digest& MD5Digest::update(StringRef s)
+{
+	if (EVP_DigestUpdate(_context, s.data(), s.size()) != 1)
+	{
+		throw std::runtime_error("Could not update MD5 digest.");
+	}
+	
+	return *this;
+}
+
+MD5Digest& MD5Digest::update(char c)
+{
+	return update(StringRef(&c, 1));
+}
+
+MD5Digest::Hex MD5Digest::finish()
+{
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int size = 0;
+	
+	if (EVP_DigestFinal_ex(_context, digest, &size) != 1 || size * 2 != HEX_SIZE
+		|| EVP_DigestInit_ex(_context, EVP_md5(), nullptr) != 1)
+	{
+		throw std::runtime_error("Could not finish MD5 digest.");
+	}
+	
+	static const char hexDigits[] = "0123456789abcdef";
+	
+	Hex hex;
+	for (unsigned int i = 0; i < size; i++)
+	{
+		hex[2 * i] = hexDigits[digest[i] >> 4];
+		hex[2 * i + 1] = hexDigits[digest[i] & 0x0f];
+	}
+	
+	return hex;
+}
+
+bool MD5Digest::equals(StringRef s, const Hex& hex)
+{
+	return s.size() == hex.size() && CRYPTO_memcmp(s.data(), hex.data(), hex.size()) == 0;
+}
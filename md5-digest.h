@@ -0,0 +1,42 @@
+#pragma once
+
+#include "http-request.h"
+
+#include <array>
+#include <cstddef>
+
+#include <openssl/evp.h>
+
+
+// Incremental MD5 (OpenSSL EVP) hex encoded into a fixed buffer.
+// The context is reused after finish(), so the hashing doesn't allocate.
+class MD5Digest final
+{
+public:
+	static const std::size_t HEX_SIZE = 32;
+	using Hex = std::array<char, HEX_SIZE>;
+	
+public:
+	MD5Digest(const MD5Digest&) = delete;
+	MD5Digest& operator=(const MD5Digest&) = delete;
+	
+	MD5Digest();
+	~MD5Digest();
+	
+	MD5Digest& update(StringRef s);
+	MD5Digest& update(char c);
+	
+	MD5Digest& update(const Hex& hex)
+	{
+		return update(StringRef(hex.data(), hex.size()));
+	}
+	
+	// lower case hex, the context is ready for the next digest
+	Hex finish();
+	
+	// constant-time comparison, the length is not secret
+	static bool equals(StringRef s, const Hex& hex);
+	
+private:
+	EVP_MD_CTX* _context = nullptr;
+};
@@ -0,0 +1,160 @@
+#include "metrics.h"
+
+#include <cstdio>
+
+
+const std::size_t Counter::CACHE_LINE_SIZE;
+const std::size_t Histogram::BUCKETS_COUNT;
+
+// 100 us ... 10 s
+const std::array<std::chrono::microseconds, Histogram::BUCKETS_COUNT - 1> Histogram::BOUNDS = 
+{{
+	std::chrono::microseconds(100),
+	std::chrono::microseconds(250),
+	std::chrono::microseconds(500),
+	std::chrono::microseconds(1000),
+	std::chrono::microseconds(2500),
+	std::chrono::microseconds(5000),
+	std::chrono::microseconds(10000),
+	std::chrono::microseconds(25000),
+	std::chrono::microseconds(50000),
+	std::chrono::microseconds(100000),
+	std::chrono::microseconds(250000),
+	std::chrono::microseconds(500000),
+	std::chrono::microseconds(1000000),
+	std::chrono::microseconds(2500000),
+	std::chrono::microseconds(5000000),
+	std::chrono::microseconds(10000000)
+}};
+
+
+Histogram::Snapshot& Histogram::Snapshot::operator+=(const Snapshot& other)
+{
+	for (std::size_t i = 0; i < BUCKETS_COUNT; i++)
+	{
+		counts[i] += other.counts[i];
+	}
+	
+	sum += other.sum;
+	return *this;
+}
+
+void Histogram::observe(std::chrono::microseconds value)
+{
+	std::size_t i = 0;
+	while (i < BOUNDS.size() && value > BOUNDS[i])
+	{
+		i++;
+	}
+	
+	_counts[i].add();
+	_sum.add(value.count() > 0 ? value.count() : 0);
+}
+
+Histogram::Snapshot Histogram::snapshot() const
+{
+	Snapshot snapshot;
+	for (std::size_t i = 0; i < BUCKETS_COUNT; i++)
+	{
+		snapshot.counts[i] = _counts[i].value();
+	}
+	
+	snapshot.sum = _sum.value();
+	return snapshot;
+}
+
+
+void MetricsWriter::header(const char* name, const char* type, const char* help)
+{
+	_text += "# HELP ";
+	_text += name;
+	_text += ' ';
+	_text += help;
+	_text += "\n# TYPE ";
+	_text += name;
+	_text += ' ';
+	_text += type;
+	_text += '\n';
+}
+
+void MetricsWriter::value(const char* name, const std::string& labels, std::uint64_t value)
+{
+	sample(name, "", labels, std::string(), std::to_string(value));
+}
+
+void MetricsWriter::value(const char* name, const std::string& labels, double value)
+{
+	char buffer[32];
+	std::snprintf(buffer, sizeof(buffer), "%.6g", value);
+	sample(name, "", labels, std::string(), buffer);
+}
+
+void MetricsWriter::histogram(const char* name, const std::string& labels, 
+							const Histogram::Snapshot& snapshot)
+{
+	std::uint64_t count = 0;
+	for (std::size_t i = 0; i < Histogram::BUCKETS_COUNT; i++)
+	{
+		count += snapshot.counts[i];
+		
+		char bound[32] = "+Inf";
+		if (i < Histogram::BOUNDS.size())
+		{
+			std::snprintf(bound, sizeof(bound), "%g", Histogram::BOUNDS[i].count() / 1e6);
+		}
+		
+		sample(name, "_bucket", labels, label("le", bound), std::to_string(count));
+	}
+	
+	char sum[32];
+	std::snprintf(sum, sizeof(sum), "%.6f", snapshot.sum / 1e6);
+	sample(name, "_sum", labels, std::string(), sum);
+	sample(name, "_count", labels, std::string(), std::to_string(count));
+}
+
+std::string MetricsWriter::label(const char* name, const std::string& value)
+{
+	std::string l(name);
+	l += "=\"";
+	for (char c : value)
+	{
+		if (c == '\\' || c == '"')
+		{
+			l += '\\';
+			l += c;
+		}
+		else if (c == '\n')
+		{
+			l += "\\n";
+		}
+		else
+		{
+			l += c;
+		}
+	}
+	l += '"';
+	return l;
+}
+
+void MetricsWriter::sample(const char* name, const char* suffix, const std::string& labels, 
+						const std::string& extraLabel, const std::string& value)
+{
+	_text += name;
+	_text += suffix;
+	
+	if (!labels.empty() || !extraLabel.empty())
+	{
+		_text += '{';
+		_text += labels;
+		if (!labels.empty() && !extraLabel.empty())
+		{
+			_text += ',';
+		}
+		_text += extraLabel;
+		_text += '}';
+	}
+	
+	_text += ' ';
+	_text += value;
+	_text += '\n';
+}
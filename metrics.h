@@ -0,0 +1,108 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+// The counter written by a single thread and read by any (the metrics 
+// scrape). The update is a plain load and store, without the locked 
+// read-modify-write. Padded to the cache line, so the counters of
+// different threads never share one.
+class Counter final
+{
+public:
+	static const std::size_t CACHE_LINE_SIZE = 64;
+	
+public:
+	Counter(const Counter&) = delete;
+	Counter& operator=(const Counter&) = delete;
+	
+	Counter()
+		: _value(0)
+	{
+	}
+	
+	void add(std::uint64_t n = 1)
+	{
+		_value.store(_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+	
+	void set(std::uint64_t value)
+	{
+		_value.store(value, std::memory_order_relaxed);
+	}
+	
+	std::uint64_t value() const
+	{
+		return _value.load(std::memory_order_relaxed);
+	}
+	
+private:
+	std::atomic<std::uint64_t> _value;
+	char _padding[CACHE_LINE_SIZE - sizeof(std::atomic<std::uint64_t>)];
+};
+
+
+// Latency histogram with fixed buckets, written by a single thread
+class Histogram final
+{
+public:
+	// the upper bounds of the buckets, the last one is +Inf
+	static const std::size_t BUCKETS_COUNT = 17;
+	static const std::array<std::chrono::microseconds, BUCKETS_COUNT - 1> BOUNDS;
+	
+	struct Snapshot
+	{
+		std::array<std::uint64_t, BUCKETS_COUNT> counts = {};	// not cumulative
+		std::uint64_t sum = 0;	// microseconds
+		
+		Snapshot& operator+=(const Snapshot& other);
+	};
+	
+public:
+	Histogram(const Histogram&) = delete;
+	Histogram& operator=(const Histogram&) = delete;
+	
+	Histogram() = default;
+	
+	void observe(std::chrono::microseconds value);
+	Snapshot snapshot() const;
+	
+private:
+	std::array<Counter, BUCKETS_COUNT> _counts;
+	Counter _sum;
+};
+
+
+// Writes the metrics in Prometheus text exposition format.
+// labels are 'name="value",...' without braces, may be empty.
+class MetricsWriter final
+{
+public:
+	// HELP and TYPE lines, once per metric
+	void header(const char* name, const char* type, const char* help);
+	
+	void value(const char* name, const std::string& labels, std::uint64_t value);
+	void value(const char* name, const std::string& labels, double value);
+	
+	// the sum is reported in seconds
+	void histogram(const char* name, const std::string& labels, const Histogram::Snapshot& snapshot);
+	
+	const std::string& text() const
+	{
+		return _text;
+	}
+	
+	// escaped label value
+	static std::string label(const char* name, const std::string& value);
+	
+private:
+	void sample(const char* name, const char* suffix, const std::string& labels, 
+				const std::string& extraLabel, const std::string& value);
+	
+	std::string _text;
+};
@@ -5,49 +5,157 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 
 #include <unistd.h>
 
 #include <cassert>
+#include <cerrno>
 #include <cstring>
 
 #include <algorithm>
-#include <array>
-#include <chrono>
-#include <functional>
 #include <iostream>
-#include <iomanip>
 #include <iterator>
 #include <sstream>
 #include <stdexcept>
-#include <thread>
+#include <tuple>
 
-#include <openssl/md5.h>
+
+namespace
+{
+
+// the length of the request up to the empty line ending the headers, or npos.
+// the lines may end with bare LF, as HttpRequest::parse tolerates them.
+std::size_t headersLength(const std::string& request)
+{
+	std::size_t eol = request.find('\n');
+	while (eol != std::string::npos)
+	{
+		if (eol + 1 < request.length() && request[eol + 1] == '\n')
+		{
+			return eol + 2;
+		}
+		
+		if (eol + 2 < request.length() && request[eol + 1] == '\r' && request[eol + 2] == '\n')
+		{
+			return eol + 3;
+		}
+		
+		eol = request.find('\n', eol + 1);
+	}
+	
+	return std::string::npos;
+}
+
+// the labels of the per-client metrics
+std::string clientLabels(const StreamStats::Client& client, const std::vector<std::string>& streamLabels)
+{
+	struct in_addr addr;
+	addr.s_addr = client.address;
+	
+	return streamLabels[client.stream] + "," + MetricsWriter::label("address", inet_ntoa(addr)) 
+		+ "," + MetricsWriter::label("sock", std::to_string(client.sock));
+}
+
+// the decimal number without sign, return false if it's malformed or over the limit
+bool parseNumber(StringRef s, unsigned limit, unsigned& value)
+{
+	if (s.empty() || s.size() > 9)
+	{
+		return false;
+	}
+	
+	value = 0;
+	for (std::size_t i = 0; i < s.size(); i++)
+	{
+		if (s[i] < '0' || s[i] > '9')
+		{
+			return false;
+		}
+		value = value * 10 + (s[i] - '0');
+	}
+	
+	return value <= limit;
+}
+
+// the tier of the stream is asked by the query, e.g. "width=320&q=50".
+// the other parameters are ignored, return false if the tier is malformed.
+bool parseTier(StringRef query, JpegTranscoder::Tier& tier)
+{
+	while (!query.empty())
+	{
+		const std::size_t end = query.find('&');
+		const StringRef param = query.substr(0, end);
+		query = query.substr(end != StringRef::npos ? end + 1 : query.size());
+		
+		const std::size_t eq = param.find('=');
+		const StringRef key = param.substr(0, eq);
+		const StringRef value = param.substr(eq != StringRef::npos ? eq + 1 : param.size());
+		
+		unsigned n = 0;
+		if (key.equals("width"))
+		{
+			if (!parseNumber(value, JpegTranscoder::MAX_TIER_WIDTH, n) || n == 0)
+			{
+				return false;
+			}
+			tier.width = n;
+		}
+		else if (key.equals("q"))
+		{
+			if (!parseNumber(value, 100, n) || n == 0)
+			{
+				return false;
+			}
+			tier.quality = static_cast<int>(n);
+		}
+	}
+	
+	return true;
+}
+
+}
 
 
-const std::size_t MJPEGServer::MAX_CLIENTS_CONNECTIONS = 16;
-const std::size_t MJPEGServer::MAX_QUEUED_FRAMES = 8;
+const std::size_t MJPEGServer::DEFAULT_SENDERS_COUNT = 1;
+const std::size_t MJPEGServer::DEFAULT_TRANSCODERS_COUNT = 2;
+const std::size_t MJPEGServer::DEFAULT_MAX_CLIENTS = 1024;
+const std::size_t MJPEGServer::MAX_REQUEST_SIZE = 8192;
+const std::size_t MJPEGServer::DEFAULT_MAX_REQUESTS_PER_CONNECTION = 100;
+const char* const MJPEGServer::METRICS_PATH = "/metrics";
 
 
 MJPEGServer::MJPEGServer(unsigned short port)
 	: _port(port)
-	, _isRunning(ATOMIC_FLAG_INIT)
 {
 	// generate opaque value for HTTP Digest authentication
-	// just arbitrary string of hex-characters	
-	_opaque.resize(32, ' ');
-	std::srand(std::time(nullptr));
-	std::generate(_opaque.begin(), _opaque.end(), 
-		[]()
+	const NonceCache::Nonce opaque = NonceCache::random();
+	_opaque.assign(opaque.data(), opaque.size());
+}
+
+std::size_t MJPEGServer::setCredentials(const std::list<std::string>& credentials)
+{
+	_credentials.clear();
+	
+	std::size_t malformed = 0;
+	for (const std::string& line : credentials)
+	{
+		if (!_credentials.add(line))
 		{
-			int r = std::rand() % 16;
-			return (r >= 0 && r <= 9) ? (r + '0') : ((r - 10) + 'a');
-		});
+			malformed++;
+		}
+	}
+	
+	return malformed;
 }
 
 MJPEGServer::~MJPEGServer()
 {
+	if (_worker.joinable())
+	{
+		stop();
+	}
 }
 
 void MJPEGServer::start()
@@ -58,6 +166,11 @@ void MJPEGServer::start()
 		throw std::logic_error("MJPEG server already started.");
 	}
 	
+	if (_streams.empty())
+	{
+		addStream("/");
+	}
+	
 	if ((_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1)
 	{
 		perror("socket()");
@@ -95,639 +208,1283 @@ void MJPEGServer::start()
 		throw std::runtime_error("Could not start MJPEG server. Could not start listening the socket.");
 	}
 	
-	_isRunning.test_and_set(std::memory_order_relaxed);
+	// the edge-triggered listener must be drained even when the process is out 
+	// of descriptors, the client is accepted on this one and rejected then
+	_reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	
+	_admissionControl.setLimits(_maxClients, _maxClientsPerAddress);
 	
-	_listenWorker = std::thread(&MJPEGServer::listenWorker, this);
-	_streamWorker = std::thread(&MJPEGServer::streamWorker, this);
+	_unavailableResponse = "HTTP/1.0 503 Service Unavailable\r\n"
+		"Connection: close\r\n"
+		"Retry-After: " + std::to_string(_retryAfter.count()) + "\r\n"
+		"Content-Length: 0\r\n"
+		"\r\n";
+	
+	try
+	{
+		std::unique_ptr<EventLoop> eventLoop(new EventLoop());
+		eventLoop->add(_sock, EPOLLIN | EPOLLET);
+		_stopEvent = eventLoop->createEvent();
+		_eventLoop = std::move(eventLoop);
+		
+		std::vector<const FrameSlot*> frameSlots;
+		for (const std::unique_ptr<Stream>& stream : _streams)
+		{
+			frameSlots.push_back(&stream->frameSlot);
+		}
+		
+		// the tiers are not served without libjpeg, the clients get the streams as published
+		if (_transcodersCount != 0)
+		{
+			try
+			{
+				_transcoder.reset(new TranscoderPool(_transcodersCount, _outMutex, 
+					[this]()
+					{
+						for (std::unique_ptr<StreamSender>& sender : _senders)
+						{
+							sender->notifyFrame();
+						}
+					}));
+			}
+			catch (const std::exception& ex)
+			{
+				std::lock_guard<std::mutex> lg(_outMutex);
+				std::cerr << "The stream tiers are not available: " << ex.what() << std::endl;
+			}
+		}
+		
+		for (std::size_t i = 0; i < _sendersCount; i++)
+		{
+			_senders.emplace_back(new StreamSender(frameSlots, _streamSettings, 
+												_admissionControl, _outMutex, _transcoder.get()));
+			_senders.back()->start();
+		}
+		
+		if (_transcoder)
+		{
+			_transcoder->start();
+		}
+	}
+	catch (...)
+	{
+		if (_transcoder)
+		{
+			_transcoder->stop();
+		}
+		_senders.clear();
+		_transcoder.reset();
+		_eventLoop.reset();
+		close(_sock);
+		_sock = -1;
+		close(_reserveFd);
+		_reserveFd = -1;
+		throw;
+	}
+	
+	_worker = std::thread(&MJPEGServer::eventLoop, this);
 }
 
 void MJPEGServer::stop()
 {
-	_isRunning.clear(std::memory_order_relaxed);
+	if (!_eventLoop)
+	{
+		return;
+	}
+	
+	EventLoop::signalEvent(_stopEvent);
+	
+	if (_worker.joinable())
+	{
+		_worker.join();
+	}
 	
-	_listenWorker.join();
 	shutdown(_sock, 2);
 	close(_sock);
 	_sock = -1;
+	close(_reserveFd);
+	_reserveFd = -1;
+	
+	for (const auto& kv : _handshakes)
+	{
+		close(kv.first);
+		_admissionControl.release(kv.second.address);
+	}
+	
+	_handshakes.clear();
+	_handshakeDeadlines.clear();
+	_idleDeadlines.clear();
+	_lingerDeadlines.clear();
+	_eventLoop.reset();
+	_stopEvent = -1;
+	
+	const StreamStats stats = streamStats();
+	
+	// the transcoder notifies the senders
+	if (_transcoder)
+	{
+		_transcoder->stop();
+	}
 	
-	_streamWorker.join();
-	for (int s : _clients)
+	for (std::unique_ptr<StreamSender>& sender : _senders)
 	{
-		shutdown(s, 2);
-		close(s);		
+		sender->stop();
 	}
+	_senders.clear();
+	_transcoder.reset();
 	
-	_clients.clear();
+	if (stats.framesSent != 0)
+	{
+		std::lock_guard<std::mutex> lg(_outMutex);
+		std::cout << "Sent " << stats.framesSent << " frames, " << stats.sendCalls 
+			<< " send calls (" << static_cast<double>(stats.sendCalls) / stats.framesSent 
+			<< " per frame)." << std::endl;
+	}
 }
 
-void MJPEGServer::putFrame(const std::vector<unsigned char>& frame)
+std::size_t MJPEGServer::clientsCount() const
+{
+	return _admissionControl.connectionsCount();
+}
+
+MJPEGServer::StreamStats MJPEGServer::streamStats() const
+{
+	StreamStats stats;
+	for (const std::unique_ptr<StreamSender>& sender : _senders)
+	{
+		const StreamStats senderStats = sender->streamStats();
+		stats.framesSent += senderStats.framesSent;
+		stats.sendCalls += senderStats.sendCalls;
+	}
+	return stats;
+}
+
+std::size_t MJPEGServer::addStream(const std::string& path)
 {
-	assert(!frame.empty());
+	if (_sock != -1)
+	{
+		throw std::logic_error("The streams should be added before start.");
+	}
 	
-	std::lock_guard<std::mutex> lg(_payloadsMutex);
-	while (_payloads.size() > MAX_QUEUED_FRAMES)
+	if (path.empty() || path[0] != '/' || path == METRICS_PATH || _streamPaths.count(path) != 0)
 	{
-		_payloads.pop_front();
+		throw std::logic_error("Invalid or duplicate stream path '" + path + "'.");
 	}
 	
-	_payloads.emplace_back(frame);
+	_streams.emplace_back(new Stream());
+	Stream& stream = *_streams.back();
+	stream.path = path;
+	stream.snapshotPath = (path.back() == '/' ? path : path + "/") + "snapshot.jpg";
+	_streamPaths.emplace(stream.path, _streams.size() - 1);
+	_snapshotPaths.emplace(stream.snapshotPath, _streams.size() - 1);
+	
+	return _streams.size() - 1;
+}
+
+void MJPEGServer::setCaptureMode(std::size_t stream, const std::string& format, 
+								unsigned width, unsigned height, double fps)
+{
+	assert(stream < _streams.size());
+	
+	Stream& s = *_streams[stream];
+	s.captureFormat = format;
+	s.captureWidth = width;
+	s.captureHeight = height;
+	s.captureFps = fps;
+}
+
+void MJPEGServer::setEncoder(std::size_t stream, const EncoderPool* encoder)
+{
+	assert(stream < _streams.size());
+	_streams[stream]->encoder = encoder;
+}
+
+void MJPEGServer::putFrame(std::size_t stream, FramePtr frame)
+{
+	assert(frame && frame->size() != 0);
+	assert(stream < _streams.size());
+	
+	Stream& s = *_streams[stream];
+	const std::chrono::steady_clock::time_point capturedAt = frame->capturedAt();
+	const std::chrono::steady_clock::time_point createdAt = frame->createdAt();
+	
+	s.frameSlot.publish(std::move(frame));
+	s.framesCaptured.fetch_add(1, std::memory_order_relaxed);
+	
+	// the single writer of the histograms, see Stream
+	s.dequeueLatency.observe(std::chrono::duration_cast<std::chrono::microseconds>(
+		createdAt - capturedAt));
+	s.publishLatency.observe(std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - createdAt));
+	
+	for (std::unique_ptr<StreamSender>& sender : _senders)
+	{
+		sender->notifyFrame();
+	}
+}
+
+void MJPEGServer::putFrame(FramePtr frame)
+{
+	putFrame(0, std::move(frame));
+}
+
+void MJPEGServer::putFrame(std::vector<unsigned char>&& frame)
+{
+	putFrame(std::make_shared<Frame>(std::move(frame)));
+}
+
+void MJPEGServer::putFrame(const std::vector<unsigned char>& frame)
+{
+	putFrame(std::vector<unsigned char>(frame));
 }
 
-void MJPEGServer::listenWorker()
+void MJPEGServer::eventLoop()
 {
 	try
 	{
-		fd_set fds;
+		bool stopRequested = false;
 		
-		while (_isRunning.test_and_set(std::memory_order_relaxed))
+		while (!stopRequested)
 		{
-			FD_ZERO(&fds);
-			FD_SET(_sock, &fds);
-			
-			struct timeval tv = { 0 };
-			tv.tv_sec = 4;
-			
-			if (select(_sock + 1, &fds, NULL, NULL, &tv) == -1)
-			{
-				std::lock_guard<std::mutex> lg(_outMutex);
-				perror("select()");
-				continue;
-			}
-			
-			if (FD_ISSET(_sock, &fds))
+			// wake up when the oldest handshake expires
+			const int n = _eventLoop->wait(expireHandshakes());
+			for (int i = 0; i < n; i++)
 			{
-				struct sockaddr_in saddr;
-				socklen_t slen = sizeof(saddr);
-				int sock = accept(_sock, (struct sockaddr*)&saddr, &slen);
-				if (sock == -1)
-				{
-					std::lock_guard<std::mutex> lg(_outMutex);
-					perror("accept()");
-					std::cerr << "Could not serve client." << std::endl;
-					continue;
-				}
-				
-				// TO DO: check the number of currently served clients,
-				// respond with error, if threshold is reached
-
-				char buffer[4096];
-				int nbytes = recv(sock, buffer, sizeof(buffer), 0);
-				if (nbytes < 0)
-				{
-					std::lock_guard<std::mutex> lg(_outMutex);
-					perror("recv()");
-					std::cerr << "Could not recv data from client's socket." << std::endl;
-					continue;
-				}
-				
-				buffer[nbytes] = '\0';
-
-				const char* cltAddrIP = inet_ntoa(saddr.sin_addr);
-				
+				const struct epoll_event& event = _eventLoop->event(i);
+				const int fd = event.data.fd;
+				if (fd == _stopEvent)
 				{
-					std::lock_guard<std::mutex> lg(_outMutex);
-					std::cout << "Client connected (sock " << sock << "). IP " << cltAddrIP << std::endl;
-					std::cout << "Headers:\n" << buffer << std::endl;
+					stopRequested = true;
 				}
-				
-				const std::string authorizationHeader = getHeader(buffer, "Authorization");
-				const std::pair<std::string, std::string> methodAndUrl = getMethodAndUrl(buffer);
-				
-				if (authorizationHeader.empty())
+				else if (fd == _sock)
 				{
-					std::string authenticateHeader = digestAuthentication();
-					
-					if (!sendResponse(sock, 401, {{"WWW-Authenticate", authenticateHeader}, {"Content-Length", "0"} }))
-					{
-						std::lock_guard<std::mutex> lg(_outMutex);
-						std::cerr << "Could not send response via client's socket." << std::endl;
-					}					
-					close(sock);
-					continue;
+					acceptClients();
 				}
-				
-				if (!authorization(sock, authorizationHeader, methodAndUrl.first))
+				else
 				{
-					close(sock);
-					continue;
+					handleClientEvent(fd);
 				}
-							
-				// authorized, add headers to response				
-				const std::map<std::string, std::string> headers
-				{
-					{ "Cache-Control", "no-cache" },
-					{ "Pragma", "no-cache" },
-					{ "Content-Type", "multipart/x-mixed-replace; boundary=mjpegstream" }
-				};
-				
-				if (!sendResponse(sock, 200, headers))
-				{
-					std::lock_guard<std::mutex> lg(_outMutex);
-					std::cerr << "Could not send response via client's socket." << std::endl;
-					close(sock);
-					continue;
-				}	
-				
-				// add socket to the list of served clients				
-				{
-					std::lock_guard<std::mutex> lg(_clientsMutex);
-					_clients.push_back(sock);
-				}				
 			}
-		
-			std::this_thread::sleep_for(std::chrono::microseconds(1000));
 		}
-		
-		_isRunning.clear(std::memory_order_relaxed);
 	}
 	catch (const std::exception& ex)
 	{
 		{
 			std::lock_guard<std::mutex> lg(_outMutex);
-			std::cerr << "Exception (listen worker): " << ex.what() << std::endl;
+			std::cerr << "Exception (event loop): " << ex.what() << std::endl;
 		}
 	}
 	catch (...)
 	{
 		{
 			std::lock_guard<std::mutex> lg(_outMutex);
-			std::cerr << "Exception (listen worker): unknown." << std::endl;
+			std::cerr << "Exception (event loop): unknown." << std::endl;
 		}
 	}
 }
 
-void MJPEGServer::streamWorker()
+void MJPEGServer::acceptClients()
 {
-	try
+	// the listening socket is edge-triggered, so accept
+	// all pending connections until the queue is drained
+	while (true)
 	{
-		std::string header;
-		header += "--mjpegstream\r\n";
-		header += "Content-Type: image/jpeg\r\n";
-		header += "Content-Length: ";
-		
-		while (_isRunning.test_and_set(std::memory_order_relaxed))
+		struct sockaddr_in saddr;
+		socklen_t slen = sizeof(saddr);
+		int sock = accept4(_sock, (struct sockaddr*)&saddr, &slen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock == -1)
 		{
-			std::array<int, MAX_CLIENTS_CONNECTIONS> clients;
-			clients.fill(-1);
-			std::size_t n = 0;
+			if ((errno == EMFILE || errno == ENFILE) && shedClient())
+			{
+				continue;
+			}
 			
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
 			{
-				std::lock_guard<std::mutex> lg(_clientsMutex);
-				if ((n = std::min(_clients.size(), MAX_CLIENTS_CONNECTIONS)) > 0)
-				{
-					std::copy_n(_clients.cbegin(), n, clients.begin());
-				}
+				std::lock_guard<std::mutex> lg(_outMutex);
+				perror("accept()");
+				std::cerr << "Could not serve client." << std::endl;
 			}
 			
-			if (n != 0)
+			if (errno == EINTR || errno == ECONNABORTED)
 			{
-				std::vector<unsigned char> payload;
-				
-				{
-					std::lock_guard<std::mutex> lg(_payloadsMutex);
-					if (!_payloads.empty())
-					{
-						payload = std::move(_payloads.front());
-						_payloads.pop_front();
-					}
-				}
-				
-				if (!payload.empty())
-				{
-					std::array<int, MAX_CLIENTS_CONNECTIONS> lostClients;
-					lostClients.fill(-1);
-					
-					std::string hdr(header);
-					hdr += std::to_string(payload.size());
-					hdr += "\r\n\r\n";
-					
-					for (std::size_t i = 0; i < n; i++)
-					{
-						int s = clients[i];
-						int nbytes = send(s, hdr.c_str(), hdr.length(), 0);
-						if (nbytes < 0)
-						{
-							lostClients[i] = s;
-							std::lock_guard<std::mutex> lg(_outMutex);
-							perror("send()");
-							std::cerr << "Could not send data (header) to client's socket." << std::endl;
-							continue;
-						}
-						
-						nbytes = send(s, payload.data(), payload.size(), 0);
-						if (nbytes < 0)
-						{
-							lostClients[i] = s;
-							std::lock_guard<std::mutex> lg(_outMutex);
-							perror("send()");
-							std::cerr << "Could not send data (payload) to client's socket. send() failed." << std::endl;
-							continue;
-						}
-					}
-					
-					if (std::find_if(lostClients.cbegin(), lostClients.cend(), 
-						[](int x){ return x != -1; }) != lostClients.cend())
-					{
-						std::lock_guard<std::mutex> lg(_clientsMutex);
-						for (std::size_t i = 0; i < n; i++)
-						{
-							int s = -1;
-							if ((s = lostClients[i]) != -1)
-							{
-								shutdown(s, 2);
-								close(s);								
-								_clients.remove(s);
-							}
-						}
-					}
-				}
+				continue;
 			}
 			
-			std::this_thread::sleep_for(std::chrono::microseconds(1000));
+			break;
 		}
 		
-		_isRunning.clear(std::memory_order_relaxed);
-	}
-	catch (const std::exception& ex)
-	{
+		// reject the client over the limits before reading anything,
+		// the response is prepared beforehand
+		const std::uint32_t address = saddr.sin_addr.s_addr;
+		if (!_admissionControl.admit(address))
 		{
-			std::lock_guard<std::mutex> lg(_outMutex);
-			std::cerr << "Exception (stream worker): " << ex.what() << std::endl;
+			send(sock, _unavailableResponse.data(), _unavailableResponse.length(), 
+				MSG_DONTWAIT | MSG_NOSIGNAL);
+			close(sock);
+			_metrics.rejected.add();
+			continue;
 		}
-	}
-	catch (...)
-	{
+		
 		{
 			std::lock_guard<std::mutex> lg(_outMutex);
-			std::cerr << "Exception (stream worker): unknown." << std::endl;
+			std::cout << "Client connected (sock " << sock << "). IP " 
+				<< inet_ntoa(saddr.sin_addr) << std::endl;
+		}
+		
+		try
+		{
+			_eventLoop->add(sock, EPOLLIN | EPOLLRDHUP | EPOLLET);
+		}
+		catch (const std::exception& ex)
+		{
+			{
+				std::lock_guard<std::mutex> lg(_outMutex);
+				std::cerr << ex.what() << std::endl;
+			}
+			close(sock);
+			_admissionControl.release(address);
+			continue;
 		}
+		
+		_metrics.accepted.add();
+		
+		// the request is accumulated until all headers are received
+		Handshake& handshake = _handshakes[sock];
+		handshake.address = address;
+		handshake.acceptedAt = std::chrono::steady_clock::now();
+		setDeadline(sock, handshake, _handshakeDeadlines, _handshakeTimeout);
 	}
 }
 
-std::string MJPEGServer::digestAuthentication()
+bool MJPEGServer::shedClient()
 {
-	const bool STALE_NONCE = false;
+	if (_reserveFd == -1)
+	{
+		return false;
+	}
 	
-	std::string authenticateHeader("Digest");
-	authenticateHeader += " realm=\"" + _realm + "\"";
-	authenticateHeader += ", nonce=\"" + generateNonce() + "\"";
-	authenticateHeader += ", stale=" + std::string(STALE_NONCE ? "true" : "false");
-	authenticateHeader += ", algorithm=MD5";
-	authenticateHeader += ", qop=\"auth\"";
-	authenticateHeader += ", opaque=\"" + _opaque + "\"";
+	close(_reserveFd);
+	const int sock = accept4(_sock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	const int error = errno;
+	if (sock != -1)
+	{
+		send(sock, _unavailableResponse.data(), _unavailableResponse.length(), 
+			MSG_DONTWAIT | MSG_NOSIGNAL);
+		close(sock);
+		_metrics.rejected.add();
+	}
 	
-	// std::cout << "digest auth header " << authenticateHeader << std::endl;
-
-	return authenticateHeader;	
+	_reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	
+	// the error of accept is reported by the caller
+	errno = error;
+	return sock != -1;
 }
 
-bool MJPEGServer::sendResponse(int sock, int code, 
-		const std::map<std::string, std::string>& headers/* = {}*/)
+void MJPEGServer::handleClientEvent(int sock)
 {
-	assert(sock > 0);
-	std::string response;
+	std::unordered_map<int, Handshake>::const_iterator it = _handshakes.find(sock);
+	if (it == _handshakes.end())
+	{
+		return;
+	}
 	
-
-	switch (code)
+	// the pending response is finished first, then the next requests are served
+	if (!it->second.response.empty())
 	{
-	case 200:
-		response = "HTTP/1.0 200 OK\r\n";
-		break;
-	case 400:
-		response = "HTTP/1.0 400 Bad Request\r\n";
-		break;
-	case 401:
-		response = "HTTP/1.0 401 Unauthorized\r\n";
-		break;		
-	case 404:
-		response = "HTTP/1.0 404 Not Found\r\n";
-		break;
-	default:
-		std::cerr << " The response " << code << " is not implemented yet." << std::endl;
-		assert(false);
+		writeResponse(sock);
 	}
 	
-	// add this header for all types of response
-	response += "Connection: close\r\n";
-	
-	// it's caller's responsibility to provide correct header(s)
-	for (const auto& kv : headers)
-	{
-		response += kv.first + ": " + kv.second + "\r\n";
-	}
-	response += "\r\n";
-
-	// send response
-	int nbytes = send(sock, response.c_str(), response.length(), 0);
-	if (nbytes < 0)
-	{
-		std::lock_guard<std::mutex> lg(_outMutex);
-		perror("send()");
-		return false;
-	}
-	
-	return true;
+	serveRequests(sock);
 }
 
-bool MJPEGServer::authorization(int sock, const std::string& header, const std::string& httpMethod)
+void MJPEGServer::serveRequests(int sock)
 {
-	assert(sock > 0);
-	assert(!header.empty());
-	
-	// kind of authorization
-	std::size_t p = header.find_first_of(' ');
-	if (p == std::string::npos)
+	// the socket is edge-triggered, so it's read until EAGAIN. the requests
+	// are served one by one (pipelining), the next one is not read until
+	// the response to the previous one is sent.
+	char buffer[4096];
+	while (true)
 	{
-		if (!sendResponse(sock, 400, {{"Content-Length", "0"}}))
+		std::unordered_map<int, Handshake>::iterator it = _handshakes.find(sock);
+		if (it == _handshakes.end())
 		{
-			std::lock_guard<std::mutex> lg(_outMutex);
-			std::cerr << "Could not send response via client's socket." << std::endl;
+			// closed or handed over to the stream sender
+			return;
 		}
-		return false;
-	}
-	
-	const std::string authorizationKind = header.substr(0, p);
-	const std::string authorizationData = header.substr(p + 1);
-	
-	if (authorizationKind == "Digest")
-	{
-		const std::map<std::string, std::string> authData = parseAuthData(authorizationData);
-		std::function<std::string (const std::string&)> getValByKey = 
-			[&authData](const std::string& k)
+		
+		Handshake& handshake = it->second;
+		if (!handshake.response.empty())
+		{
+			// resumed on EPOLLOUT
+			return;
+		}
+		
+		// the request may come in several segments, wait for the end of headers
+		const std::size_t length = !handshake.lingering ? headersLength(handshake.request) : std::string::npos;
+		if (length != std::string::npos)
+		{
+			// parsed in place, the served request is erased unless
+			// the connection is closed or handed over meanwhile
+			serveRequest(sock, StringRef(handshake.request.data(), length));
+			
+			it = _handshakes.find(sock);
+			if (it != _handshakes.end())
 			{
-				decltype(authData)::const_iterator it = authData.find(k);
-				return it != authData.cend() ? it->second : "";
-			};
-		
-		const std::string username(getValByKey("username"));
-		std::list<std::string>::const_iterator it = 
-			std::find_if(_credentials.cbegin(), _credentials.cend(), 
-						[&username](const std::string& credentials)
-						{
-							return (credentials.compare(0, username.length(), username) == 0);
-						});
-						
-		if (it == _credentials.cend())
+				it->second.request.erase(0, length);
+			}
+			continue;
+		}
+		
+		if (handshake.request.length() > MAX_REQUEST_SIZE)
 		{
-			return false;
-		}		
+			_metrics.badRequests.add();
+			sendResponse(sock, 400, {{"Content-Length", "0"}});
+			continue;
+		}
 		
-		// TO DO: no necessary get password as substring
-		// 1. copy credentials to s1
-		// 2. get position of ':' in s1, and insert another one after
-		// 3. insert _realm between two colons
-		std::size_t p = it->find_first_of(':');
-		if (p == std::string::npos)
+		ssize_t nbytes = recv(sock, buffer, sizeof(buffer), 0);
+		if (nbytes > 0)
 		{
-			return false;
+			// the rest of the request is discarded, when the connection is closing
+			if (!handshake.lingering)
+			{
+				handshake.request.append(buffer, nbytes);
+			}
+			continue;
 		}
 		
-		std::string s1(username);
-		s1.push_back(':');
-		s1.append(_realm);
-		s1.push_back(':');
-		s1.append(it->substr(p + 1));	// password
+		if (nbytes < 0 && errno == EINTR)
+		{
+			continue;
+		}
 		
+		if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return;
+		}
 		
-		// TO DO: check the opaque
-		// TO DO: check nonce (decode received nonce, 
-		// convert to seconds and compare with current time.
-		// the difference should not be greater than 3 min)
+		// the reset is the usual way to close the idle persistent connection
+		if (nbytes < 0 && errno != ECONNRESET)
+		{
+			std::lock_guard<std::mutex> lg(_outMutex);
+			perror("recv()");
+			std::cerr << "Could not recv data from client's socket." << std::endl;
+		}
 		
-		std::function<std::string (const std::string&)> md5Hash 
-			= [](const std::string& s)
-			{
-				unsigned char digest[MD5_DIGEST_LENGTH];
-				unsigned char* src = reinterpret_cast<unsigned char*>(const_cast<char*>(s.c_str()));
-				MD5(src, s.length(), digest);
+		// the connection is closed before the request is complete
+		dropHandshake(sock);
+		return;
+	}
+}
 
-				std::ostringstream oss;
-				for (size_t i = 0; i < MD5_DIGEST_LENGTH; i++)
-				{
-					unsigned char x = digest[i];
-					oss << std::hex << std::setw(2) 
-						<< std::setfill('0') << static_cast<unsigned short>(x);
-				}
-				return oss.str();
-			};
-		
-		std::string h1(md5Hash(s1));	
+int MJPEGServer::expireHandshakes()
+{
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	
+	const int timeouts[] = 
+	{
+		expireDeadlines(_handshakeDeadlines, now, "Handshake timeout", &_metrics.handshakeTimeouts),
+		expireDeadlines(_idleDeadlines, now, "Keep-alive timeout", &_metrics.idleTimeouts),
+		expireDeadlines(_lingerDeadlines, now, nullptr, nullptr)
+	};
+	
+	int timeout = -1;
+	for (int t : timeouts)
+	{
+		if (t != -1 && (timeout == -1 || t < timeout))
+		{
+			timeout = t;
+		}
+	}
+	
+	return timeout;
+}
 
-		std::cout << "s1 = '" << s1 << "'" << std::endl;
-		std::cout << "h1 = '" << h1 << "'" << std::endl;
-		
-		std::string s2(httpMethod);
-		s2.push_back(':');
-		s2.append(getValByKey("uri"));
-			
-		std::string h2(md5Hash(s2));
+int MJPEGServer::expireDeadlines(std::deque<HandshakeDeadline>& deadlines, 
+								std::chrono::steady_clock::time_point now, const char* reason, 
+								Counter* expired)
+{
+	// the deadlines are ordered, since the timeout is the same for all of them.
+	// the deadlines of completed handshakes are skipped.
+	while (!deadlines.empty())
+	{
+		const HandshakeDeadline& deadline = deadlines.front();
 		
-		std::cout << "s2 = '" << s2 << "'" << std::endl;
-		std::cout << "h2 = '" << h2 << "'" << std::endl;		
+		std::unordered_map<int, Handshake>::iterator it = _handshakes.find(deadline.sock);
+		if (it == _handshakes.end() || it->second.id != deadline.id)
+		{
+			deadlines.pop_front();
+			continue;
+		}
 		
-		std::string s3(h1);
-		const std::string qop(getValByKey("qop"));
-		s3.push_back(':');
-		s3.append(getValByKey("nonce"));
-		s3.push_back(':');		
+		if (deadline.expiresAt > now)
+		{
+			// round up, otherwise the loop wakes up a bit earlier and spins
+			return static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+				deadline.expiresAt - now).count()) + 1;
+		}
 		
-		if (!qop.empty())
+		if (reason != nullptr)
 		{
-			s3.append(getValByKey("nc"));
-			s3.push_back(':');
-			s3.append(getValByKey("cnonce"));
-			s3.push_back(':');
-			s3.append(qop);
-			s3.push_back(':');
+			std::lock_guard<std::mutex> lg(_outMutex);
+			std::cerr << reason << " (sock " << deadline.sock << ")." << std::endl;
 		}
-			
-		s3.append(h2);
 		
-		std::string h3(md5Hash(s3));
+		const int sock = deadline.sock;
+		deadlines.pop_front();
+		dropHandshake(sock);
+		if (expired != nullptr)
+		{
+			expired->add();
+		}
+	}
+	
+	return -1;
+}
+
+void MJPEGServer::setDeadline(int sock, Handshake& handshake, 
+							std::deque<HandshakeDeadline>& deadlines, std::chrono::milliseconds timeout)
+{
+	// the new id makes the previous deadline of the connection stale
+	handshake.id = ++_handshakesCount;
+	
+	HandshakeDeadline deadline;
+	deadline.sock = sock;
+	deadline.id = handshake.id;
+	deadline.expiresAt = std::chrono::steady_clock::now() + timeout;
+	
+	deadlines.push_back(deadline);
+}
 
-		// std::cout << "s3 = '" << s3 << "'" << std::endl;		
-		// std::cout << "h3 = '" << h3 << "'" << std::endl;			
-		// std::cout << "h3 = " << h3 << ", response = " << getValByKey("response") << std::endl;
+void MJPEGServer::serveRequest(int sock, StringRef request)
+{
+	HttpRequest httpRequest;
+	if (!httpRequest.parse(request))
+	{
+		_metrics.badRequests.add();
+		sendResponse(sock, 400, {{"Content-Length", "0"}});
+		return;
+	}
+	
+	// the stream is selected by the path, its tier by the query
+	const StringRef url = httpRequest.url();
+	const std::size_t queryStart = url.find('?');
+	const StringRef path = url.substr(0, queryStart);
+	const StringRef query = url.substr(queryStart != StringRef::npos ? queryStart + 1 : url.size());
+	
+	if (_publicMetrics && path.equals(METRICS_PATH))
+	{
+		serveMetrics(sock, httpRequest);
+		return;
+	}
+	
+	if (httpRequest.header("Authorization").empty())
+	{
+		reply(sock, httpRequest, 401, {{"WWW-Authenticate", digestAuthentication()}, {"Content-Length", "0"}});
+		return;
+	}
+	
+	switch (authorization(httpRequest))
+	{
+	case Authorization::Authorized:
+		break;
+		
+	case Authorization::Unauthorized:
+		_metrics.authFailures.add();
+		reply(sock, httpRequest, 401, {{"WWW-Authenticate", digestAuthentication()}, {"Content-Length", "0"}});
+		return;
 		
-		return h3 == getValByKey("response");
+	case Authorization::Stale:
+		// the credentials are right, the client retries with a new nonce without prompting
+		_metrics.staleNonces.add();
+		reply(sock, httpRequest, 401, {{"WWW-Authenticate", digestAuthentication(true)}, {"Content-Length", "0"}});
+		return;
+		
+	case Authorization::Malformed:
+		// unsupported or malformed authorization
+		_metrics.badRequests.add();
+		sendResponse(sock, 400, {{"Content-Length", "0"}});
+		return;
+	}
+	
+	std::unordered_map<StringRef, std::size_t, StringRefHash, StringRefEqual>::const_iterator snapshot = 
+		_snapshotPaths.find(path);
+	if (snapshot != _snapshotPaths.end())
+	{
+		serveSnapshot(sock, *_streams[snapshot->second], httpRequest);
+		return;
 	}
-	else
+	
+	std::unordered_map<StringRef, std::size_t, StringRefHash, StringRefEqual>::const_iterator stream = 
+		_streamPaths.find(path);
+	if (stream == _streamPaths.end())
 	{
-		// unsupported authorization
-		if (!sendResponse(sock, 400, {{"Content-Length", "0"}}))
+		if (path.equals(METRICS_PATH))
 		{
-			std::lock_guard<std::mutex> lg(_outMutex);
-			std::cerr << "Could not send response via client's socket." << std::endl;
+			serveMetrics(sock, httpRequest);
+			return;
 		}
-		return false;
+		
+		reply(sock, httpRequest, 404, {{"Content-Length", "0"}});
+		return;
 	}
 	
-	// unauthorized
-	if (!sendResponse(sock, 401, {{"Content-Length", "0"}}))
+	JpegTranscoder::Tier tier;
+	if (!parseTier(query, tier))
 	{
-		std::lock_guard<std::mutex> lg(_outMutex);
-		std::cerr << "Could not send response via client's socket." << std::endl;
+		_metrics.badRequests.add();
+		reply(sock, httpRequest, 400, {{"Content-Length", "0"}});
+		return;
 	}
-	return false;
+				
+	// authorized, add headers to response				
+	const std::map<std::string, std::string> headers
+	{
+		{ "Cache-Control", "no-cache" },
+		{ "Pragma", "no-cache" },
+		{ "Content-Type", "multipart/x-mixed-replace; boundary=mjpegstream" }
+	};
+	
+	// the client is handed over to the stream sender once the head is sent,
+	// the rest of pipelined requests is ignored
+	std::unordered_map<int, Handshake>::iterator it = _handshakes.find(sock);
+	assert(it != _handshakes.end());
+	it->second.handOver = true;
+	it->second.stream = stream->second;
+	it->second.tier = tier;
+	sendResponse(sock, 200, headers);
 }
 
-std::string MJPEGServer::getHeader(const std::string& request,
-									const std::string& headerName)
+void MJPEGServer::handOver(int sock)
 {
-	std::string headerValue;
+	std::unordered_map<int, Handshake>::iterator it = _handshakes.find(sock);
+	assert(it != _handshakes.end());
+	const std::uint32_t address = it->second.address;
+	const std::size_t stream = it->second.stream;
+	const JpegTranscoder::Tier tier = it->second.tier;
+	_metrics.duration.observe(std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - it->second.acceptedAt));
+	_handshakes.erase(it);
 	
-	std::size_t p = request.find(headerName);
-	if (p != std::string::npos)
+	try
 	{
-		p += headerName.length() + 2;
-		std::size_t p1 = request.find("\r\n", p);
-		if (p1 != std::string::npos)
-		{
-			headerValue = request.substr(p, p1 - p);
-		}
+		_eventLoop->remove(sock);
+	}
+	catch (const std::exception& ex)
+	{
+		std::lock_guard<std::mutex> lg(_outMutex);
+		std::cerr << ex.what() << std::endl;
+		rejectClient(sock, address);
+		return;
 	}
 	
-	return headerValue;
+	leastLoadedSender().addClient(sock, address, stream, tier);
 }
 
-std::pair<std::string, std::string> MJPEGServer::getMethodAndUrl(const std::string& request)
+void MJPEGServer::serveSnapshot(int sock, const Stream& stream, const HttpRequest& request)
 {
-	std::string method;
-	std::string url;
+	std::uint64_t sequence = 0;
+	FramePtr frame = stream.frameSlot.latest(sequence);
+	if (!frame)
+	{
+		// nothing is captured yet
+		reply(sock, request, 503, {{"Retry-After", std::to_string(_retryAfter.count())}, 
+								{"Content-Length", "0"}});
+		return;
+	}
 	
-	std::size_t p = request.find_first_of(' ');
-	if (p != std::string::npos)
+	// the sequence is unique within the process only, so the tag 
+	// is prefixed with the opaque, which is random per process
+	const std::string etag = "\"" + _opaque.substr(0, 8) + "-" + std::to_string(sequence) + "\"";
+	
+	const StringRef ifNoneMatch = request.header("If-None-Match");
+	if (ifNoneMatch.equals("*") || std::search(ifNoneMatch.data(), ifNoneMatch.data() + ifNoneMatch.size(),
+			etag.begin(), etag.end()) != ifNoneMatch.data() + ifNoneMatch.size())
 	{
-		method = request.substr(0, p);
-		p += 1;
-		std::size_t p1 = request.find_first_of(' ', p);
-		if (p1 != std::string::npos)
-		{
-			url = request.substr(p, p1 - p);
-		}
+		_metrics.notModified.add();
+		reply(sock, request, 304, {{"ETag", etag}, {"Cache-Control", "no-cache"}});
+		return;
 	}
-
-	return {method, url};
+	
+	const std::map<std::string, std::string> headers
+	{
+		{ "Content-Type", "image/jpeg" },
+		{ "Content-Length", std::to_string(frame->size()) },
+		{ "Cache-Control", "no-cache" },
+		{ "ETag", etag }
+	};
+	
+	_metrics.snapshots.add();
+	reply(sock, request, 200, headers, std::move(frame));
 }
 
-std::string MJPEGServer::generateNonce()
+void MJPEGServer::serveMetrics(int sock, const HttpRequest& request)
 {
-	// the simple method:
-	// 1. get current time +3 min
-	// 2. convert to string, encode with base64
+	const std::string text = metrics();
+	
+	const std::map<std::string, std::string> headers
+	{
+		{ "Content-Type", "text/plain; version=0.0.4" },
+		{ "Content-Length", std::to_string(text.length()) },
+		{ "Cache-Control", "no-cache" }
+	};
+	
+	reply(sock, request, 200, headers, 
+		std::make_shared<Frame>(std::vector<unsigned char>(text.begin(), text.end())));
+}
 
-/* 	
-	std::time_t now = std::time(nullptr);
-	now += 180;
-	struct tm* timeinfo = std::localtime(&now);
+std::string MJPEGServer::metrics()
+{
+	StreamStats stats;
+	for (const std::unique_ptr<StreamSender>& sender : _senders)
+	{
+		stats += sender->streamStats();
+	}
+	stats.streams.resize(_streams.size());
 	
-	std::ostringstream oss;
-	oss << timeinfo->tm_mday << '-'
-		<< timeinfo->tm_mon + 1 << '-'
-		<< timeinfo->tm_year + 1900 << ' '
-		<< timeinfo->tm_hour << ':'
-		<< timeinfo->tm_min << ':'
-		<< timeinfo->tm_sec;
-		
-	std::string nonce = macaron::Base64::Encode(oss.str());
-	while (nonce.back() == '=')
+	std::vector<std::string> streamLabels;
+	for (const std::unique_ptr<Stream>& stream : _streams)
+	{
+		streamLabels.push_back(MetricsWriter::label("stream", stream->path));
+	}
+	
+	MetricsWriter w;
+	
+	w.header("mjpeg_capture_frames_total", "counter", "Frames published to the stream.");
+	for (std::size_t i = 0; i < _streams.size(); i++)
+	{
+		w.value("mjpeg_capture_frames_total", streamLabels[i], 
+				_streams[i]->framesCaptured.load(std::memory_order_relaxed));
+	}
+	
+	w.header("mjpeg_capture_mode_info", "gauge", "The format and the frame size the source captures in.");
+	for (std::size_t i = 0; i < _streams.size(); i++)
+	{
+		const Stream& stream = *_streams[i];
+		if (!stream.captureFormat.empty())
+		{
+			w.value("mjpeg_capture_mode_info", streamLabels[i] 
+					+ "," + MetricsWriter::label("format", stream.captureFormat)
+					+ "," + MetricsWriter::label("width", std::to_string(stream.captureWidth))
+					+ "," + MetricsWriter::label("height", std::to_string(stream.captureHeight)),
+					static_cast<std::uint64_t>(1));
+		}
+	}
+	
+	w.header("mjpeg_capture_mode_fps", "gauge", "The frame rate granted by the source, 0 if unknown.");
+	for (std::size_t i = 0; i < _streams.size(); i++)
+	{
+		const Stream& stream = *_streams[i];
+		if (!stream.captureFormat.empty())
+		{
+			w.value("mjpeg_capture_mode_fps", streamLabels[i], stream.captureFps);
+		}
+	}
+	
+	w.header("mjpeg_encoded_frames_total", "counter", "Raw frames encoded to JPEG.");
+	for (std::size_t i = 0; i < _streams.size(); i++)
+	{
+		if (_streams[i]->encoder != nullptr)
+		{
+			w.value("mjpeg_encoded_frames_total", streamLabels[i], _streams[i]->encoder->framesEncoded());
+		}
+	}
+	
+	w.header("mjpeg_encoder_frames_dropped_total", "counter", 
+			"Raw frames dropped while all the encoders were busy.");
+	for (std::size_t i = 0; i < _streams.size(); i++)
+	{
+		if (_streams[i]->encoder != nullptr)
+		{
+			w.value("mjpeg_encoder_frames_dropped_total", streamLabels[i], 
+					_streams[i]->encoder->framesDropped());
+		}
+	}
+	
+	w.header("mjpeg_encode_errors_total", "counter", "Raw frames which could not be encoded.");
+	for (std::size_t i = 0; i < _streams.size(); i++)
+	{
+		if (_streams[i]->encoder != nullptr)
+		{
+			w.value("mjpeg_encode_errors_total", streamLabels[i], _streams[i]->encoder->encodeErrors());
+		}
+	}
+	
+	w.header("mjpeg_capture_dequeue_latency_seconds", "histogram", 
+			"Time from the capture until the frame is taken from the source.");
+	for (std::size_t i = 0; i < _streams.size(); i++)
+	{
+		w.histogram("mjpeg_capture_dequeue_latency_seconds", streamLabels[i], 
+					_streams[i]->dequeueLatency.snapshot());
+	}
+	
+	w.header("mjpeg_capture_publish_latency_seconds", "histogram", 
+			"Time from taking the frame from the source until it's published.");
+	for (std::size_t i = 0; i < _streams.size(); i++)
+	{
+		w.histogram("mjpeg_capture_publish_latency_seconds", streamLabels[i], 
+					_streams[i]->publishLatency.snapshot());
+	}
+	
+	w.header("mjpeg_stream_frames_sent_total", "counter", "Frames completely sent to the clients.");
+	for (std::size_t i = 0; i < _streams.size(); i++)
+	{
+		w.value("mjpeg_stream_frames_sent_total", streamLabels[i], stats.streams[i].framesSent);
+	}
+	
+	w.header("mjpeg_stream_bytes_sent_total", "counter", "Bytes sent to the clients, part headers included.");
+	for (std::size_t i = 0; i < _streams.size(); i++)
+	{
+		w.value("mjpeg_stream_bytes_sent_total", streamLabels[i], stats.streams[i].bytesSent);
+	}
+	
+	w.header("mjpeg_stream_frames_skipped_total", "counter", 
+			"Frames skipped by the clients busy with the previous frame.");
+	for (std::size_t i = 0; i < _streams.size(); i++)
+	{
+		w.value("mjpeg_stream_frames_skipped_total", streamLabels[i], stats.streams[i].framesSkipped);
+	}
+	
+	w.header("mjpeg_send_first_byte_latency_seconds", "histogram", 
+			"Time from publishing the frame until its first byte is sent to a client.");
+	for (std::size_t i = 0; i < _streams.size(); i++)
+	{
+		w.histogram("mjpeg_send_first_byte_latency_seconds", streamLabels[i], 
+					stats.streams[i].firstByteLatency);
+	}
+	
+	w.header("mjpeg_send_duration_seconds", "histogram", 
+			"Time from the first byte of the frame until the last one is sent to a client.");
+	for (std::size_t i = 0; i < _streams.size(); i++)
 	{
-		nonce.pop_back();
+		w.histogram("mjpeg_send_duration_seconds", streamLabels[i], stats.streams[i].sendDuration);
 	}
 	
-	return nonce;
-	* */
+	w.header("mjpeg_frame_latency_seconds", "histogram", 
+			"Time from the frame capture until it's completely sent to a client.");
+	for (std::size_t i = 0; i < _streams.size(); i++)
+	{
+		w.histogram("mjpeg_frame_latency_seconds", streamLabels[i], stats.streams[i].latency);
+	}
+	
+	w.header("mjpeg_send_calls_total", "counter", "Send syscalls of the stream senders.");
+	w.value("mjpeg_send_calls_total", std::string(), stats.sendCalls);
+	w.header("mjpeg_partial_writes_total", "counter", "Sends which did not take all the data.");
+	w.value("mjpeg_partial_writes_total", std::string(), stats.partialWrites);
+	w.header("mjpeg_send_errors_total", "counter", "Sends failed with an error.");
+	w.value("mjpeg_send_errors_total", std::string(), stats.sendErrors);
+	w.header("mjpeg_slow_clients_dropped_total", "counter", "Clients disconnected for the backlog.");
+	w.value("mjpeg_slow_clients_dropped_total", std::string(), stats.slowClientsDropped);
 	
-	// TO DO: return back to previos method, 
-	// when base64 implementation will be ready
+	w.header("mjpeg_clients", "gauge", "Clients receiving the streams.");
+	w.value("mjpeg_clients", std::string(), static_cast<std::uint64_t>(stats.clients.size()));
 	
-	// generate nonce value for HTTP Digest authentication
-	// just arbitrary string of hex-characters	
-	std::string nonce(32, ' ');
-	std::srand(std::time(nullptr));
-	std::generate(nonce.begin(), nonce.end(), 
-		[]()
+	// the clients by the tier, the tiers nobody watches are not transcoded
+	std::map<std::tuple<std::size_t, unsigned, int>, std::uint64_t> tierClients;
+	for (const StreamStats::Client& client : stats.clients)
+	{
+		if (!client.tier.original())
 		{
-			int r = std::rand() % 16;
-			return (r >= 0 && r <= 9) ? (r + '0') : ((r - 10) + 'a');
-		});	
-	return nonce;
+			tierClients[std::make_tuple(client.stream, client.tier.width, client.tier.quality)]++;
+		}
+	}
+	
+	w.header("mjpeg_tier_clients", "gauge", "Clients receiving the stream transcoded to the tier.");
+	for (const auto& kv : tierClients)
+	{
+		w.value("mjpeg_tier_clients", streamLabels[std::get<0>(kv.first)]
+				+ "," + MetricsWriter::label("width", std::to_string(std::get<1>(kv.first)))
+				+ "," + MetricsWriter::label("quality", std::to_string(std::get<2>(kv.first))),
+				kv.second);
+	}
+	
+	if (_transcoder)
+	{
+		w.header("mjpeg_transcoded_frames_total", "counter", "Frames transcoded to the tiers.");
+		w.value("mjpeg_transcoded_frames_total", std::string(), _transcoder->framesTranscoded());
+		w.header("mjpeg_transcode_errors_total", "counter", "Frames which could not be transcoded.");
+		w.value("mjpeg_transcode_errors_total", std::string(), _transcoder->transcodeErrors());
+	}
+	w.header("mjpeg_handshakes", "gauge", "Connections not handed over to the stream senders.");
+	w.value("mjpeg_handshakes", std::string(), static_cast<std::uint64_t>(_handshakes.size()));
+	
+	w.header("mjpeg_connections_accepted_total", "counter", "Connections accepted.");
+	w.value("mjpeg_connections_accepted_total", std::string(), _metrics.accepted.value());
+	w.header("mjpeg_connections_rejected_total", "counter", "Connections rejected over the limits.");
+	w.value("mjpeg_connections_rejected_total", std::string(), _metrics.rejected.value());
+	w.header("mjpeg_handshake_timeouts_total", "counter", "Connections closed by the handshake timeout.");
+	w.value("mjpeg_handshake_timeouts_total", std::string(), _metrics.handshakeTimeouts.value());
+	w.header("mjpeg_idle_timeouts_total", "counter", "Persistent connections closed by the idle timeout.");
+	w.value("mjpeg_idle_timeouts_total", std::string(), _metrics.idleTimeouts.value());
+	w.header("mjpeg_bad_requests_total", "counter", "Malformed or too large requests.");
+	w.value("mjpeg_bad_requests_total", std::string(), _metrics.badRequests.value());
+	w.header("mjpeg_auth_failures_total", "counter", "Requests with wrong credentials.");
+	w.value("mjpeg_auth_failures_total", std::string(), _metrics.authFailures.value());
+	w.header("mjpeg_stale_nonces_total", "counter", "Requests with expired, unknown or replayed nonces.");
+	w.value("mjpeg_stale_nonces_total", std::string(), _metrics.staleNonces.value());
+	w.header("mjpeg_snapshots_total", "counter", "Snapshots sent.");
+	w.value("mjpeg_snapshots_total", std::string(), _metrics.snapshots.value());
+	w.header("mjpeg_snapshots_not_modified_total", "counter", "Snapshot requests answered with 304.");
+	w.value("mjpeg_snapshots_not_modified_total", std::string(), _metrics.notModified.value());
+	
+	w.header("mjpeg_handshake_duration_seconds", "histogram", 
+			"Time from the accept until the stream is started.");
+	w.histogram("mjpeg_handshake_duration_seconds", std::string(), _metrics.duration.snapshot());
+	
+	w.header("mjpeg_client_connected_seconds", "gauge", "Time since the client started receiving the stream.");
+	for (const StreamStats::Client& client : stats.clients)
+	{
+		w.value("mjpeg_client_connected_seconds", clientLabels(client, streamLabels), 
+				std::chrono::duration<double>(client.connected).count());
+	}
+	
+	w.header("mjpeg_client_frames_sent_total", "counter", "Frames completely sent to the client.");
+	for (const StreamStats::Client& client : stats.clients)
+	{
+		w.value("mjpeg_client_frames_sent_total", clientLabels(client, streamLabels), client.framesSent);
+	}
+	
+	w.header("mjpeg_client_bytes_sent_total", "counter", "Bytes sent to the client.");
+	for (const StreamStats::Client& client : stats.clients)
+	{
+		w.value("mjpeg_client_bytes_sent_total", clientLabels(client, streamLabels), client.bytesSent);
+	}
+	
+	w.header("mjpeg_client_frames_skipped_total", "counter", "Frames skipped by the client.");
+	for (const StreamStats::Client& client : stats.clients)
+	{
+		w.value("mjpeg_client_frames_skipped_total", clientLabels(client, streamLabels), client.framesSkipped);
+	}
+	
+	return w.text();
 }
 
-std::map<std::string, std::string> MJPEGServer::parseAuthData(const std::string& data)
+void MJPEGServer::reply(int sock, const HttpRequest& request, int code, 
+						const std::map<std::string, std::string>& headers, FramePtr body/* = nullptr*/)
 {
-	std::map<std::string, std::string> kvData;
+	std::unordered_map<int, Handshake>::iterator it = _handshakes.find(sock);
+	assert(it != _handshakes.end());
+	Handshake& handshake = it->second;
+	
+	// HTTP/1.1 connections are persistent by default, HTTP/1.0 ones on request
+	const bool http11 = request.version().equals("HTTP/1.1");
+	const StringRef connection = request.header("Connection");
+	bool keepAlive = http11 ? !connection.iequals("close") : connection.iequals("keep-alive");
+	keepAlive = keepAlive && ++handshake.requestsCount < _maxRequestsPerConnection;
+	
+	startResponse(sock, responseHead(code, headers, http11, keepAlive), std::move(body), keepAlive);
+}
+
+void MJPEGServer::startResponse(int sock, std::string head, FramePtr body, bool keepAlive)
+{
+	std::unordered_map<int, Handshake>::iterator it = _handshakes.find(sock);
+	assert(it != _handshakes.end());
+	Handshake& handshake = it->second;
+	
+	handshake.response = std::move(head);
+	handshake.body = std::move(body);
+	handshake.offset = 0;
+	handshake.keepAlive = keepAlive;
 	
-	std::function<std::pair<std::string, std::string>(const std::string&)> getKeyValue = 
-		[](const std::string& s)
+	if (!writeResponse(sock))
 	{
-		std::string k, v;
-		std::size_t p = s.find_first_of('=');
-		if (p == std::string::npos)
+		it = _handshakes.find(sock);
+		if (it != _handshakes.end() && !it->second.response.empty())
 		{
-			return std::make_pair(k, v);
+			// the handshake timeout covers sending of the response too
+			setDeadline(sock, it->second, _handshakeDeadlines, _handshakeTimeout);
 		}
+	}
+}
+
+bool MJPEGServer::writeResponse(int sock)
+{
+	std::unordered_map<int, Handshake>::iterator it = _handshakes.find(sock);
+	if (it == _handshakes.end())
+	{
+		return false;
+	}
+	
+	Handshake& handshake = it->second;
+	const std::string& header = handshake.response;
+	const std::size_t bodySize = handshake.body ? handshake.body->size() : 0;
+	
+	while (handshake.offset < header.length() + bodySize)
+	{
+		struct iovec iov[2];
+		int iovcnt = 0;
 		
-		k = s.substr(0, p);
-		p += 1;
+		std::size_t offset = handshake.offset;
+		if (offset < header.length())
+		{
+			iov[iovcnt].iov_base = const_cast<char*>(header.data() + offset);
+			iov[iovcnt].iov_len = header.length() - offset;
+			iovcnt += 1;
+			offset = 0;
+		}
+		else
+		{
+			offset -= header.length();
+		}
 		
-		while (p < s.length() && s[p] == '\"')
+		if (bodySize != 0)
 		{
-			p += 1;
+			iov[iovcnt].iov_base = const_cast<unsigned char*>(handshake.body->data() + offset);
+			iov[iovcnt].iov_len = bodySize - offset;
+			iovcnt += 1;
 		}
 		
-		v = s.substr(p);		
-		while (v.back() == '\"')
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		
+		ssize_t nbytes = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (nbytes < 0)
 		{
-			v.pop_back();
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				if (handshake.waitingWritable)
+				{
+					return false;
+				}
+				
+				// resume when the socket becomes writable
+				try
+				{
+					_eventLoop->modify(sock, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+					handshake.waitingWritable = true;
+					return false;
+				}
+				catch (const std::exception& ex)
+				{
+					std::lock_guard<std::mutex> lg(_outMutex);
+					std::cerr << ex.what() << std::endl;
+				}
+			}
+			else
+			{
+				std::lock_guard<std::mutex> lg(_outMutex);
+				perror("sendmsg()");
+			}
+			
+			dropHandshake(sock);
+			return false;
 		}
 		
-		return std::make_pair(k, v);
-	};
-	
-	std::size_t p0 = 0, p1 = 0;
+		handshake.offset += nbytes;
+	}
 	
-	p1 = data.find_first_of(',');
-	if (p1 == std::string::npos)
+	if (handshake.handOver)
 	{
-		p1 = data.length();
-	}	
+		handOver(sock);
+		return false;
+	}
 	
-	std::size_t len = p1 - p0;
-	while (len != 0)
+	handshake.response.clear();
+	handshake.body.reset();
+	handshake.offset = 0;
+	
+	if (handshake.waitingWritable)
 	{
-		std::string tmp(data.substr(p0, len));
-		std::pair<std::string, std::string> kv = getKeyValue(tmp);
-		if (!kv.first.empty() && !kv.second.empty())
+		try
 		{
-			kvData.emplace(kv.first, kv.second);
+			_eventLoop->modify(sock, EPOLLIN | EPOLLRDHUP | EPOLLET);
+			handshake.waitingWritable = false;
 		}
-		
-		if (p1 == data.length())
+		catch (const std::exception& ex)
 		{
-			break;
+			{
+				std::lock_guard<std::mutex> lg(_outMutex);
+				std::cerr << ex.what() << std::endl;
+			}
+			dropHandshake(sock);
+			return false;
+		}
+	}
+	
+	if (!handshake.keepAlive)
+	{
+		// closed with the unread request (e.g. the rest of the too large one), 
+		// the connection would be reset and the client could lose the response.
+		// so the sending is shut down, and the rest is read and discarded 
+		// until the client closes or the linger timeout expires.
+		shutdown(sock, SHUT_WR);
+		handshake.lingering = true;
+		handshake.request.clear();
+		setDeadline(sock, handshake, _lingerDeadlines, _lingerTimeout);
+		return false;
+	}
+	
+	// the next request should come within the keep-alive timeout
+	setDeadline(sock, handshake, _idleDeadlines, _keepAliveTimeout);
+	return true;
+}
+
+void MJPEGServer::dropHandshake(int sock)
+{
+	std::unordered_map<int, Handshake>::iterator it = _handshakes.find(sock);
+	if (it == _handshakes.end())
+	{
+		return;
+	}
+	
+	const std::uint32_t address = it->second.address;
+	_handshakes.erase(it);
+	rejectClient(sock, address);
+}
+
+void MJPEGServer::rejectClient(int sock, std::uint32_t address)
+{
+	close(sock);
+	_admissionControl.release(address);
+}
+
+StreamSender& MJPEGServer::leastLoadedSender()
+{
+	assert(!_senders.empty());
+	
+	std::vector<std::unique_ptr<StreamSender>>::iterator it = 
+		std::min_element(_senders.begin(), _senders.end(), 
+			[](const std::unique_ptr<StreamSender>& a, const std::unique_ptr<StreamSender>& b)
+			{
+				return a->clientsCount() < b->clientsCount();
+			});
+	
+	return **it;
+}
+
+std::string MJPEGServer::digestAuthentication(bool stale/* = false*/)
+{
+	const NonceCache::Nonce nonce = _nonces.issue();
+	
+	std::string authenticateHeader("Digest");
+	authenticateHeader += " realm=\"" + _realm + "\"";
+	authenticateHeader += ", nonce=\"" + std::string(nonce.data(), nonce.size()) + "\"";
+	authenticateHeader += ", stale=" + std::string(stale ? "true" : "false");
+	authenticateHeader += ", algorithm=MD5";
+	authenticateHeader += ", qop=\"auth\"";
+	authenticateHeader += ", opaque=\"" + _opaque + "\"";
+	
+	// std::cout << "digest auth header " << authenticateHeader << std::endl;
+
+	return authenticateHeader;	
+}
+
+std::string MJPEGServer::responseHead(int code, const std::map<std::string, std::string>& headers, 
+									bool http11/* = false*/, bool keepAlive/* = false*/)
+{
+	std::string response(http11 ? "HTTP/1.1 " : "HTTP/1.0 ");
+
+	switch (code)
+	{
+	case 200:
+		response += "200 OK\r\n";
+		break;
+	case 304:
+		response += "304 Not Modified\r\n";
+		break;
+	case 400:
+		response += "400 Bad Request\r\n";
+		break;
+	case 401:
+		response += "401 Unauthorized\r\n";
+		break;		
+	case 404:
+		response += "404 Not Found\r\n";
+		break;
+	case 503:
+		response += "503 Service Unavailable\r\n";
+		break;
+	default:
+		std::cerr << " The response " << code << " is not implemented yet." << std::endl;
+		assert(false);
+	}
+	
+	// add this header for all types of response
+	response += keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+	
+	// it's caller's responsibility to provide correct header(s)
+	for (const auto& kv : headers)
+	{
+		response += kv.first + ": " + kv.second + "\r\n";
+	}
+	response += "\r\n";
+	
+	return response;
+}
+
+void MJPEGServer::sendResponse(int sock, int code, 
+		const std::map<std::string, std::string>& headers/* = {}*/)
+{
+	startResponse(sock, responseHead(code, headers), nullptr, false);
+}
+
+MJPEGServer::Authorization MJPEGServer::authorization(const HttpRequest& request)
+{
+	const StringRef header = request.header("Authorization");
+	assert(!header.empty());
+	
+	// kind of authorization
+	std::size_t p = header.find(' ');
+	if (p == StringRef::npos)
+	{
+		return Authorization::Malformed;
+	}
+	
+	const StringRef authorizationKind = header.substr(0, p);
+	const StringRef authorizationData = header.substr(p + 1);
+	
+	DigestParams authData;
+	if (authorizationKind.iequals("Digest") && authData.parse(authorizationData))
+	{
+		const CredentialStore::HA1* ha1 = _credentials.find(authData.get("username"));
+		if (ha1 == nullptr)
+		{
+			return Authorization::Unauthorized;
 		}
 		
-		p1 += 1;
-		while (p1 < data.length() && data[p1] == ' ')
+		// the nonce count is required to detect the replay
+		const StringRef qop = authData.get("qop");
+		if (!authData.get("opaque").equals(_opaque) || !qop.equals("auth"))
 		{
-			p1 += 1;
+			return Authorization::Unauthorized;
 		}
 		
-		if (p1 == data.length())
+		// the digest covers the uri param, it should be the request-target, so the header
+		// captured on one path is not accepted on another (RFC 7616, 400 otherwise)
+		const StringRef uri = authData.get("uri");
+		if (!uri.equals(request.url()))
 		{
-			break;
+			return Authorization::Malformed;
 		}
 		
-		p0 = p1;
-		p1 = data.find_first_of(',', p0);
-		if (p1 == std::string::npos)
+		// HA2 = MD5(method:uri)
+		const MD5Digest::Hex ha2 = _md5.update(request.method()).update(':').update(uri).finish();
+		
+		// response = MD5(HA1:nonce:nc:cnonce:qop:HA2)
+		const StringRef nonce = authData.get("nonce");
+		const StringRef nc = authData.get("nc");
+		const MD5Digest::Hex expected = _md5.update(*ha1).update(':').update(nonce).update(':')
+			.update(nc).update(':').update(authData.get("cnonce")).update(':')
+			.update(qop).update(':').update(ha2).finish();
+		
+		if (!MD5Digest::equals(authData.get("response"), expected))
 		{
-			p1 = data.length();
+			return Authorization::Unauthorized;
 		}
 		
-		len = p1 - p0;
+		// only the authentic request advances the nonce count
+		return _nonces.verify(nonce, nc) == NonceCache::Status::Valid 
+			? Authorization::Authorized : Authorization::Stale;
 	}
 	
-	return kvData;
+	return Authorization::Malformed;
 }
@@ -1,18 +1,42 @@
 #pragma once
 
+#include "admission-control.h"
+#include "credential-store.h"
+#include "encoder-pool.h"
+#include "event-loop.h"
+#include "frame.h"
+#include "http-request.h"
+#include "metrics.h"
+#include "nonce-cache.h"
+#include "stream-sender.h"
+#include "transcoder-pool.h"
+
 #include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 
 class MJPEGServer final
 {
-	static const std::size_t MAX_CLIENTS_CONNECTIONS;
-	static const std::size_t MAX_QUEUED_FRAMES;
+public:
+	static const std::size_t DEFAULT_SENDERS_COUNT;
+	static const std::size_t DEFAULT_TRANSCODERS_COUNT;
+	static const std::size_t DEFAULT_MAX_CLIENTS;
+	static const std::size_t MAX_REQUEST_SIZE;
+	static const std::size_t DEFAULT_MAX_REQUESTS_PER_CONNECTION;
+	static const char* const METRICS_PATH;
+	
+	using SlowClientPolicy = ::SlowClientPolicy;
+	using StreamStats = ::StreamStats;
 	
 public:
 	MJPEGServer(const MJPEGServer&) = delete;
@@ -23,48 +47,296 @@ public:
 	
 	void start();
 	void stop();
+	
+	// register the stream served at the path (e.g. "/cam0") before start(),
+	// return its index for putFrame(). if no stream is registered,
+	// start() registers the single stream at "/". METRICS_PATH is reserved.
+	std::size_t addStream(const std::string& path);
+	
+	// the mode the source of the stream captures in (e.g. "MJPG" 1920x1080 
+	// at 30 fps), it's exported in the metrics. should be set before start().
+	void setCaptureMode(std::size_t stream, const std::string& format, 
+						unsigned width, unsigned height, double fps);
+	
+	// the pool encoding the raw capture of the stream, its counters are exported
+	// in the metrics. should be set before start(), the pool should outlive stop().
+	void setEncoder(std::size_t stream, const EncoderPool* encoder);
+	
+	// publish the frame of the stream. the streams are thread-safe, but
+	// the frames of a stream should be published by one thread at a time.
+	void putFrame(std::size_t stream, FramePtr frame);
+	
+	// publish the frame of the first stream
+	void putFrame(FramePtr frame);
+	void putFrame(std::vector<unsigned char>&& frame);
 	void putFrame(const std::vector<unsigned char>& frame);
 	
-	void setCredentials(const std::list<std::string>& credentials)
+	// the lines of the credentials file, see CredentialStore::add().
+	// return the number of malformed lines, they are skipped.
+	std::size_t setCredentials(const std::list<std::string>& credentials);
+	
+	// see StreamSettings. should be set before start().
+	void setSlowClientPolicy(SlowClientPolicy policy,
+							std::chrono::milliseconds maxBacklogTime = std::chrono::milliseconds(2000),
+							std::size_t maxBacklogBytes = 8 * 1024 * 1024)
+	{
+		_streamSettings.slowClientPolicy = policy;
+		_streamSettings.maxBacklogTime = maxBacklogTime;
+		_streamSettings.maxBacklogBytes = maxBacklogBytes;
+	}
+	
+	// send the frames not smaller than minFrameSize with MSG_ZEROCOPY.
+	// should be set before start().
+	void setZeroCopy(bool enable, std::size_t minFrameSize = 32 * 1024)
+	{
+		_streamSettings.zeroCopy = enable;
+		_streamSettings.zeroCopyMinFrameSize = minFrameSize;
+	}
+	
+	// add the capture time and sequence headers to every part of the stream,
+	// see StreamSettings. should be set before start().
+	void setFrameHeaders(bool frameHeaders)
+	{
+		_streamSettings.frameHeaders = frameHeaders;
+	}
+	
+	// the number of threads sending the stream, every one serves 
+	// own shard of clients. should be set before start().
+	void setSendersCount(std::size_t sendersCount)
+	{
+		_sendersCount = sendersCount != 0 ? sendersCount : 1;
+	}
+	
+	// the number of threads transcoding the frames to the tiers the clients
+	// ask by the query of the stream URL (e.g. "/cam0?width=320&q=50"),
+	// 0 - the tiers are ignored. should be set before start().
+	void setTranscodersCount(std::size_t transcodersCount)
+	{
+		_transcodersCount = transcodersCount;
+	}
+	
+	// the limits of simultaneously connected clients, total and
+	// per IP address (0 - no limit). should be set before start().
+	void setMaxClients(std::size_t maxClients, std::size_t maxClientsPerAddress = 0)
+	{
+		_maxClients = maxClients;
+		_maxClientsPerAddress = maxClientsPerAddress;
+	}
+	
+	// the client should send the request within the timeout after connection
+	void setHandshakeTimeout(std::chrono::milliseconds handshakeTimeout)
+	{
+		_handshakeTimeout = handshakeTimeout;
+	}
+	
+	// the persistent connection is closed when it's idle for the timeout or
+	// after maxRequests responses (1 - no persistent connections)
+	void setKeepAlive(std::chrono::milliseconds idleTimeout, std::size_t maxRequests)
+	{
+		_keepAliveTimeout = idleTimeout;
+		_maxRequestsPerConnection = maxRequests != 0 ? maxRequests : 1;
+	}
+	
+	// the clients over limits are answered with '503 Service Unavailable'
+	void setRetryAfter(std::chrono::seconds retryAfter)
+	{
+		_retryAfter = retryAfter;
+	}
+	
+	// how long the client may reuse the nonce on new connections.
+	// should be set before start().
+	void setNonceLifetime(std::chrono::seconds lifetime)
+	{
+		_nonces.setLifetime(lifetime);
+	}
+	
+	// the metrics are served at METRICS_PATH in Prometheus text format,
+	// to the authorized clients unless they are public
+	void setPublicMetrics(bool publicMetrics)
 	{
-		_credentials = credentials;
+		_publicMetrics = publicMetrics;
 	}
+	
+	// the mutex of std::cout and std::cerr, the threads
+	// outside the server (e.g. the encoders) write under it too
+	std::mutex& outMutex()
+	{
+		return _outMutex;
+	}
+	
+	std::size_t clientsCount() const;
+	
+	StreamStats streamStats() const;
 		
 private:
-	void listenWorker();
-	void streamWorker();
+	// the connection until it's handed over to a stream sender. the requests
+	// are accumulated and served in order; the response (headers and body)
+	// is sent without blocking, offset points to its first unsent byte.
+	// the persistent connection serves the next request after the response.
+	struct Handshake
+	{
+		std::uint32_t address = 0;
+		std::uint64_t id = 0;	// of the current deadline
+		std::chrono::steady_clock::time_point acceptedAt;
+		std::string request;
+		std::size_t requestsCount = 0;
+		
+		std::string response;
+		FramePtr body;
+		std::size_t offset = 0;
+		bool keepAlive = false;
+		bool waitingWritable = false;
+		bool lingering = false;	// the last response is sent, the connection is closing
+		
+		// the stream the client is handed over to, once the response is sent
+		bool handOver = false;
+		std::size_t stream = 0;
+		JpegTranscoder::Tier tier;
+	};
 	
-	std::string digestAuthentication();
-	bool sendResponse(int sock, int code, const std::map<std::string, std::string>& headers = {});
+	enum class Authorization
+	{
+		Authorized,
+		Unauthorized,
+		Stale,		// the nonce is expired, unknown or replayed
+		Malformed
+	};
+	
+	// the stream served at the path, the snapshot of its latest frame
+	// is served at path/snapshot.jpg
+	struct Stream
+	{
+		std::string path;
+		std::string snapshotPath;
+		FrameSlot frameSlot;
+		std::atomic<std::uint64_t> framesCaptured{0};
+		
+		// written by putFrame() without locks, the frames of the stream are
+		// published one at a time: by the capture thread of the source, or by
+		// the encoder pool, which delivers them under its delivery mutex
+		Histogram dequeueLatency;	// from the capture until the frame is taken from the source
+		Histogram publishLatency;	// from taking the frame until it's published
+		
+		// the mode of the source, the format is empty if it's unknown
+		std::string captureFormat;
+		unsigned captureWidth = 0;
+		unsigned captureHeight = 0;
+		double captureFps = 0;
+		const EncoderPool* encoder = nullptr;	// of the raw capture
+	};
 	
-	bool authorization(int sock, const std::string& header, const std::string& httpMethod);
+	// the counters of the worker thread
+	struct HandshakeMetrics
+	{
+		Counter accepted;
+		Counter rejected;	// over the connection limits
+		Counter handshakeTimeouts;
+		Counter idleTimeouts;
+		Counter badRequests;
+		Counter authFailures;
+		Counter staleNonces;
+		Counter snapshots;
+		Counter notModified;
+		Histogram duration;	// from the accept until the stream is started
+	};
 	
-	static std::string getHeader(const std::string& request,
-								const std::string& headerName);								
-	// split request (the first line) into method:url:protocol. return method and url
-	static std::pair<std::string, std::string> getMethodAndUrl(const std::string& request);
+	struct HandshakeDeadline
+	{
+		int sock = -1;
+		std::uint64_t id = 0;
+		std::chrono::steady_clock::time_point expiresAt;
+	};
 	
-	static std::string generateNonce();
+private:
+	void eventLoop();
+	void acceptClients();
+	// accept the pending client on the reserved descriptor and reject it,
+	// return false if there is no client or no reserved descriptor
+	bool shedClient();
+	void handleClientEvent(int sock);
+	void serveRequests(int sock);
+	// close expired handshakes, return the time (ms) until the next expiration or -1
+	int expireHandshakes();
+	// the expirations are logged with the reason and counted, unless they are null
+	int expireDeadlines(std::deque<HandshakeDeadline>& deadlines, 
+						std::chrono::steady_clock::time_point now, const char* reason, 
+						Counter* expired);
+	void setDeadline(int sock, Handshake& handshake, 
+					std::deque<HandshakeDeadline>& deadlines, std::chrono::milliseconds timeout);
+	// the request refers to the handshake buffer, it's valid until the handshake is dropped
+	void serveRequest(int sock, StringRef request);
+	void serveSnapshot(int sock, const Stream& stream, const HttpRequest& request);
+	void serveMetrics(int sock, const HttpRequest& request);
+	std::string metrics();
+	// send the response without blocking. the connection is kept alive, 
+	// if the client asks and the requests limit is not reached.
+	void reply(int sock, const HttpRequest& request, int code, 
+			const std::map<std::string, std::string>& headers, FramePtr body = nullptr);
+	void startResponse(int sock, std::string head, FramePtr body, bool keepAlive);
+	// return true if the response is sent and the connection is kept alive
+	bool writeResponse(int sock);
+	// pass the client to the least loaded stream sender
+	void handOver(int sock);
+	void dropHandshake(int sock);
+	void rejectClient(int sock, std::uint32_t address);
+	StreamSender& leastLoadedSender();
 	
-	static std::map<std::string, std::string> parseAuthData(const std::string& data);
+	// the challenge with a new nonce
+	std::string digestAuthentication(bool stale = false);
+	static std::string responseHead(int code, const std::map<std::string, std::string>& headers, 
+									bool http11 = false, bool keepAlive = false);
+	// send the response without blocking and close the connection
+	void sendResponse(int sock, int code, const std::map<std::string, std::string>& headers = {});
+	
+	Authorization authorization(const HttpRequest& request);
 	
 	
 private:
 	unsigned short _port = 0;
 	int _sock = -1;
+	int _reserveFd = -1;	// released to accept a client when out of descriptors
+	
+	std::unique_ptr<EventLoop> _eventLoop;
+	int _stopEvent = -1;	// signaled by stop()
+	
+	std::unordered_map<int, Handshake> _handshakes;
+	std::deque<HandshakeDeadline> _handshakeDeadlines;
+	std::deque<HandshakeDeadline> _idleDeadlines;	// of the persistent connections
+	std::deque<HandshakeDeadline> _lingerDeadlines;	// of the closing connections
+	std::uint64_t _handshakesCount = 0;
+	std::chrono::milliseconds _handshakeTimeout = std::chrono::milliseconds(10000);
+	std::chrono::milliseconds _keepAliveTimeout = std::chrono::milliseconds(5000);
+	std::chrono::milliseconds _lingerTimeout = std::chrono::milliseconds(1000);
+	std::size_t _maxRequestsPerConnection = DEFAULT_MAX_REQUESTS_PER_CONNECTION;
+	
+	std::vector<std::unique_ptr<Stream>> _streams;
+	// the keys refer to the paths of _streams
+	std::unordered_map<StringRef, std::size_t, StringRefHash, StringRefEqual> _streamPaths;
+	std::unordered_map<StringRef, std::size_t, StringRefHash, StringRefEqual> _snapshotPaths;
+	
+	StreamSettings _streamSettings;
+	std::size_t _sendersCount = DEFAULT_SENDERS_COUNT;
+	std::vector<std::unique_ptr<StreamSender>> _senders;
+	
+	std::size_t _transcodersCount = DEFAULT_TRANSCODERS_COUNT;
+	std::unique_ptr<TranscoderPool> _transcoder;
+	
+	AdmissionControl _admissionControl;
+	std::size_t _maxClients = DEFAULT_MAX_CLIENTS;
+	std::size_t _maxClientsPerAddress = 0;
+	std::chrono::seconds _retryAfter = std::chrono::seconds(2);
+	std::string _unavailableResponse;	// 503, prepared by start()
 	
-	std::list<int> _clients;
-	std::list<std::vector<unsigned char>> _payloads;	
+	HandshakeMetrics _metrics;
+	bool _publicMetrics = false;
 	
-	std::list<std::string> _credentials;
 	std::string _realm = "mjpeg server";
+	CredentialStore _credentials{_realm};
+	MD5Digest _md5;	// used by the worker thread only
+	NonceCache _nonces;	// used by the worker thread only
 	std::string _opaque;
 	
-	std::atomic_flag _isRunning;
-	std::thread _listenWorker;
-	std::thread _streamWorker;
+	std::thread _worker;
 	
 	std::mutex _outMutex;
-	std::mutex _clientsMutex;
-	std::mutex _payloadsMutex;
 };
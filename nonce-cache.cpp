@@ -0,0 +1,122 @@
+#include "nonce-cache.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <stdexcept>
+
+#include <openssl/rand.h>
+
+
+const std::size_t NonceCache::NONCE_SIZE;
+const std::size_t NonceCache::DEFAULT_CAPACITY = 4096;
+const std::chrono::seconds NonceCache::DEFAULT_LIFETIME = std::chrono::seconds(300);
+
+
+NonceCache::NonceCache(std::size_t capacity/* = DEFAULT_CAPACITY*/,
+					std::chrono::seconds lifetime/* = DEFAULT_LIFETIME*/)
+	: _lifetime(lifetime)
+	, _entries(capacity)
+{
+	assert(capacity > 0);
+	_nonces.reserve(capacity);
+}
+
+NonceCache::Nonce NonceCache::issue()
+{
+	const Clock::time_point now = Clock::now();
+	expire(now);
+	
+	if (_count == _entries.size())
+	{
+		dropOldest();
+	}
+	
+	const std::size_t index = (_head + _count) % _entries.size();
+	Entry& entry = _entries[index];
+	
+	// a collision of 128 random bits is not expected, but the key must be unique
+	do
+	{
+		entry.nonce = random();
+	}
+	while (_nonces.count(StringRef(entry.nonce.data(), entry.nonce.size())) != 0);
+	
+	entry.issuedAt = now;
+	entry.nc = 0;
+	
+	_nonces.emplace(StringRef(entry.nonce.data(), entry.nonce.size()), index);
+	_count++;
+	
+	return entry.nonce;
+}
+
+NonceCache::Status NonceCache::verify(StringRef nonce, StringRef nc)
+{
+	expire(Clock::now());
+	
+	std::unordered_map<StringRef, std::size_t, StringRefHash, StringRefEqual>::const_iterator it = 
+		_nonces.find(nonce);
+	if (it == _nonces.end())
+	{
+		return Status::Stale;
+	}
+	
+	// 8 hex digits
+	if (nc.size() != 8)
+	{
+		return Status::Replayed;
+	}
+	
+	char buffer[9] = { 0 };
+	std::copy(nc.data(), nc.data() + nc.size(), buffer);
+	char* end = nullptr;
+	const unsigned long count = std::strtoul(buffer, &end, 16);
+	
+	Entry& entry = _entries[it->second];
+	if (end != buffer + 8 || count <= entry.nc)
+	{
+		return Status::Replayed;
+	}
+	
+	entry.nc = static_cast<std::uint32_t>(count);
+	return Status::Valid;
+}
+
+NonceCache::Nonce NonceCache::random()
+{
+	unsigned char bytes[NONCE_SIZE / 2];
+	if (RAND_bytes(bytes, sizeof(bytes)) != 1)
+	{
+		throw std::runtime_error("Could not generate random bytes.");
+	}
+	
+	static const char hexDigits[] = "0123456789abcdef";
+	
+	Nonce nonce;
+	for (std::size_t i = 0; i < sizeof(bytes); i++)
+	{
+		nonce[2 * i] = hexDigits[bytes[i] >> 4];
+		nonce[2 * i + 1] = hexDigits[bytes[i] & 0x0f];
+	}
+	
+	return nonce;
+}
+
+void NonceCache::expire(Clock::time_point now)
+{
+	while (_count != 0 && now - _entries[_head].issuedAt >= _lifetime)
+	{
+		dropOldest();
+	}
+}
+
+void NonceCache::dropOldest()
+{
+	assert(_count != 0);
+	
+	const Entry& entry = _entries[_head];
+	_nonces.erase(StringRef(entry.nonce.data(), entry.nonce.size()));
+	_head = (_head + 1) % _entries.size();
+	_count--;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "http-request.h"
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+
+// The nonces issued for HTTP Digest authentication. The table is bounded,
+// the oldest nonce is dropped when it's full. A nonce is accepted until it
+// expires and only with the nonce count greater than the last seen one,
+// so a client reuses it on new connections without the 401 round trip,
+// but the requests can't be replayed. Not thread-safe.
+class NonceCache final
+{
+public:
+	// hex encoded 16 random bytes
+	static const std::size_t NONCE_SIZE = 32;
+	using Nonce = std::array<char, NONCE_SIZE>;
+	
+	static const std::size_t DEFAULT_CAPACITY;
+	static const std::chrono::seconds DEFAULT_LIFETIME;
+	
+	enum class Status
+	{
+		Valid,
+		Stale,		// unknown or expired, the client should retry with a new nonce
+		Replayed	// the nonce count is not increased
+	};
+	
+public:
+	NonceCache(const NonceCache&) = delete;
+	NonceCache& operator=(const NonceCache&) = delete;
+	
+	explicit NonceCache(std::size_t capacity = DEFAULT_CAPACITY,
+						std::chrono::seconds lifetime = DEFAULT_LIFETIME);
+	
+	void setLifetime(std::chrono::seconds lifetime)
+	{
+		_lifetime = lifetime;
+	}
+	
+	Nonce issue();
+	
+	// nc is the hex nonce count of the request, it's remembered if the nonce is valid
+	Status verify(StringRef nonce, StringRef nc);
+	
+	std::size_t size() const
+	{
+		return _nonces.size();
+	}
+	
+	// random hex string from the OpenSSL CSPRNG
+	static Nonce random();
+	
+private:
+	using Clock = std::chrono::steady_clock;
+	
+	struct Entry
+	{
+		Nonce nonce;
+		Clock::time_point issuedAt;
+		std::uint32_t nc;
+	};
+	
+	void expire(Clock::time_point now);
+	void dropOldest();
+	
+	std::chrono::seconds _lifetime;
+	// ring of the entries in the issue order
+	std::vector<Entry> _entries;
+	std::size_t _head = 0;
+	std::size_t _count = 0;
+	// the keys refer to the nonces of _entries
+	std::unordered_map<StringRef, std::size_t, StringRefHash, StringRefEqual> _nonces;
+};
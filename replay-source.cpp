@@ -0,0 +1,344 @@
+#include "replay-source.h"
+
+#include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <unistd.h>
+
+
+const double ReplaySource::DEFAULT_FPS = 30;
+const std::chrono::microseconds ReplaySource::MAX_RECORDED_GAP = std::chrono::microseconds(1000000);
+
+
+// the mapping is shared with the frames referring it,
+// so it stays valid until the last frame is released
+struct ReplaySource::Mapping
+{
+	const unsigned char* start = nullptr;
+	std::size_t length = 0;
+	
+	~Mapping()
+	{
+		munmap(const_cast<unsigned char*>(start), length);
+	}
+};
+
+
+ReplaySource::ReplaySource(const std::string& path)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) == -1)
+	{
+		perror("stat()");
+		throw std::runtime_error("Could not open replay source " + path + ".");
+	}
+	
+	if (S_ISDIR(st.st_mode))
+	{
+		DIR* dir = opendir(path.c_str());
+		if (dir == nullptr)
+		{
+			perror("opendir()");
+			throw std::runtime_error("Could not open directory " + path + ".");
+		}
+		
+		std::vector<std::string> names;
+		while (struct dirent* entry = readdir(dir))
+		{
+			const std::string name(entry->d_name);
+			const std::size_t dot = name.rfind('.');
+			std::string extension = dot != std::string::npos ? name.substr(dot + 1) : std::string();
+			std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+			if (extension == "jpg" || extension == "jpeg")
+			{
+				names.push_back(name);
+			}
+		}
+		closedir(dir);
+		
+		std::sort(names.begin(), names.end());
+		for (const std::string& name : names)
+		{
+			indexFile(path + "/" + name, true);
+		}
+	}
+	else
+	{
+		indexFile(path, false);
+	}
+	
+	if (_frames.empty())
+	{
+		throw std::runtime_error("No JPEG frames found in " + path + ".");
+	}
+	
+	scheduleRecorded();
+}
+
+void ReplaySource::setFps(double fps)
+{
+	_maxRate = fps <= 0;
+	if (_maxRate)
+	{
+		return;
+	}
+	
+	const double interval = 1e6 / fps;
+	for (std::size_t i = 0; i < _frames.size(); i++)
+	{
+		_frames[i].offset = std::chrono::microseconds(static_cast<long long>(i * interval));
+	}
+	_loopDuration = std::chrono::microseconds(static_cast<long long>(_frames.size() * interval));
+}
+
+void ReplaySource::startCapturing()
+{
+	if (_isCapturing)
+	{
+		return;
+	}
+	
+	_isCapturing = true;
+	_next = 0;
+	_loopStartedAt = std::chrono::steady_clock::now();
+}
+
+void ReplaySource::stopCapturing()
+{
+	_isCapturing = false;
+}
+
+FramePtr ReplaySource::captureFrame()
+{
+	if (!_isCapturing)
+	{
+		startCapturing();
+	}
+	
+	if (_next == _frames.size())
+	{
+		_next = 0;
+		_loopStartedAt += _loopDuration;
+	}
+	
+	const Entry& entry = _frames[_next++];
+	
+	if (!_maxRate)
+	{
+		const std::chrono::steady_clock::time_point dueAt = _loopStartedAt + entry.offset;
+		const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (dueAt > now)
+		{
+			std::this_thread::sleep_until(dueAt);
+		}
+		else if (now - dueAt > MAX_RECORDED_GAP)
+		{
+			// the capture thread was stalled, don't catch up with a burst
+			_loopStartedAt += now - dueAt;
+		}
+	}
+	
+	std::shared_ptr<const Mapping> mapping = entry.mapping;
+	std::shared_ptr<Frame> frame = std::make_shared<Frame>(entry.data, entry.size,
+		[mapping](std::vector<unsigned char>&)
+		{
+		});
+	frame->setCaptureInfo(frame->createdAt(), _sequence++);
+	return frame;
+}
+
+void ReplaySource::indexFile(const std::string& path, bool singleFrame)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		perror("open()");
+		throw std::runtime_error("Could not open file " + path + ".");
+	}
+	
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+	{
+		perror("fstat()");
+		close(fd);
+		throw std::runtime_error("Could not stat file " + path + ".");
+	}
+	
+	if (st.st_size == 0)
+	{
+		close(fd);
+		return;
+	}
+	
+	void* start = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (start == MAP_FAILED)
+	{
+		perror("mmap()");
+		throw std::runtime_error("Could not map file " + path + ".");
+	}
+	
+	// the pages are read ahead, so the replay doesn't wait for the disk
+	madvise(start, st.st_size, MADV_WILLNEED);
+	
+	std::shared_ptr<Mapping> mapping = std::make_shared<Mapping>();
+	mapping->start = static_cast<const unsigned char*>(start);
+	mapping->length = st.st_size;
+	
+	// the images start with SOI marker followed by another marker,
+	// the recorded stream may have part headers between them
+	const unsigned char* data = mapping->start;
+	const std::size_t size = mapping->length;
+	std::size_t pos = 0;
+	while (pos + 3 <= size)
+	{
+		const unsigned char* soi = static_cast<const unsigned char*>(
+			memchr(data + pos, 0xFF, size - pos - 2));
+		if (soi == nullptr)
+		{
+			break;
+		}
+		
+		const std::size_t p = soi - data;
+		if (soi[1] != 0xD8 || soi[2] != 0xFF)
+		{
+			pos = p + 1;
+			continue;
+		}
+		
+		const std::size_t jpeg = jpegSize(soi, size - p);
+		if (jpeg == 0)
+		{
+			pos = p + 2;
+			continue;
+		}
+		
+		Entry entry;
+		entry.mapping = mapping;
+		entry.data = soi;
+		entry.size = jpeg;
+		
+		// the timestamp of the part header saved from the server
+		const std::string gap(reinterpret_cast<const char*>(data + pos), p - pos);
+		const std::size_t timestamp = gap.rfind("X-Timestamp: ");
+		long long seconds = 0;
+		long long microseconds = 0;
+		if (timestamp != std::string::npos
+			&& std::sscanf(gap.c_str() + timestamp + 13, "%lld.%lld", &seconds, &microseconds) == 2)
+		{
+			entry.timestamp = seconds * 1000000 + microseconds;
+		}
+		
+		_frames.push_back(std::move(entry));
+		pos = p + jpeg;
+		
+		if (singleFrame)
+		{
+			break;
+		}
+	}
+}
+
+void ReplaySource::scheduleRecorded()
+{
+	// the recorded intervals are followed, the unknown or too long ones
+	// are replaced with the interval of DEFAULT_FPS
+	const std::chrono::microseconds defaultInterval(static_cast<long long>(1e6 / DEFAULT_FPS));
+	
+	std::chrono::microseconds offset(0);
+	for (std::size_t i = 0; i < _frames.size(); i++)
+	{
+		if (i != 0)
+		{
+			const long long recorded = _frames[i].timestamp - _frames[i - 1].timestamp;
+			offset += _frames[i].timestamp != -1 && _frames[i - 1].timestamp != -1
+				&& recorded >= 0 && recorded <= MAX_RECORDED_GAP.count()
+				? std::chrono::microseconds(recorded) : defaultInterval;
+		}
+		
+		_frames[i].offset = offset;
+	}
+	
+	_loopDuration = offset + defaultInterval;
+	_maxRate = false;
+}
+
+std::size_t ReplaySource::jpegSize(const unsigned char* data, std::size_t size)
+{
+	assert(size >= 2 && data[0] == 0xFF && data[1] == 0xD8);
+	
+	// walk the marker segments, the entropy-coded data following SOS
+	// is scanned for the next marker (0xFF not followed by 0 or RSTn)
+	std::size_t p = 2;
+	while (p + 2 <= size)
+	{
+		if (data[p] != 0xFF)
+		{
+			return 0;
+		}
+		
+		const unsigned char marker = data[p + 1];
+		if (marker == 0xFF)
+		{
+			// fill byte
+			p += 1;
+			continue;
+		}
+		
+		if (marker == 0xD9)
+		{
+			// EOI
+			return p + 2;
+		}
+		
+		if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+		{
+			// standalone markers
+			p += 2;
+			continue;
+		}
+		
+		if (p + 4 > size)
+		{
+			return 0;
+		}
+		
+		p += 2 + ((data[p + 2] << 8) | data[p + 3]);
+		
+		if (marker == 0xDA)
+		{
+			// SOS
+			while (p < size)
+			{
+				const unsigned char* ff = static_cast<const unsigned char*>(
+					memchr(data + p, 0xFF, size - p));
+				if (ff == nullptr || ff + 1 == data + size)
+				{
+					return 0;
+				}
+				
+				p = ff - data;
+				if (ff[1] != 0x00 && !(ff[1] >= 0xD0 && ff[1] <= 0xD7))
+				{
+					break;
+				}
+				p += 2;
+			}
+		}
+	}
+	
+	return 0;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "frame.h"
+#include "frame-source.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+// Replays the recorded MJPEG stream (concatenated JPEG images, e.g. the
+// multipart stream saved from the server) or the directory of JPEG files
+// in a loop. The files are memory mapped, the frames are indexed once on
+// open and refer to the mapped memory directly, so nothing is copied.
+class ReplaySource final : public FrameSource
+{
+public:
+	static const double DEFAULT_FPS;
+	static const std::chrono::microseconds MAX_RECORDED_GAP;
+	
+public:
+	ReplaySource(const ReplaySource&) = delete;
+	ReplaySource& operator=(const ReplaySource&) = delete;
+	
+	// the path is the file or the directory (*.jpg, *.jpeg in name order)
+	explicit ReplaySource(const std::string& path);
+	
+	// replay at the fixed rate, 0 - as fast as possible. by default the
+	// recorded timestamps (X-Timestamp part headers) are followed,
+	// the frames without them are replayed at DEFAULT_FPS.
+	void setFps(double fps);
+	
+	void startCapturing() override;
+	void stopCapturing() override;
+	FramePtr captureFrame() override;
+	
+	std::size_t framesCount() const
+	{
+		return _frames.size();
+	}
+	
+private:
+	struct Mapping;
+	
+	struct Entry
+	{
+		std::shared_ptr<const Mapping> mapping;
+		const unsigned char* data = nullptr;
+		std::size_t size = 0;
+		long long timestamp = -1;	// recorded, us since the epoch
+		std::chrono::microseconds offset{0};	// from the start of the loop
+	};
+	
+private:
+	void indexFile(const std::string& path, bool singleFrame);
+	void scheduleRecorded();
+	
+	// the size of JPEG image starting with SOI, 0 if it's truncated or corrupted
+	static std::size_t jpegSize(const unsigned char* data, std::size_t size);
+	
+private:
+	std::vector<Entry> _frames;
+	std::chrono::microseconds _loopDuration{0};
+	bool _maxRate = false;
+	
+	bool _isCapturing = false;
+	std::size_t _next = 0;
+	std::chrono::steady_clock::time_point _loopStartedAt;
+	std::uint32_t _sequence = 0;
+};
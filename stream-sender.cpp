@@ -0,0 +1,867 @@
+#include "stream-sender.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include <linux/errqueue.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <iostream>
+#include <stdexcept>
+
+
+// MSG_ZEROCOPY is available since Linux 4.14
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define MJPEG_SERVER_ZEROCOPY 1
+#else
+#define MJPEG_SERVER_ZEROCOPY 0
+#endif
+
+const std::size_t StreamSender::ClientRegistry::NO_INDEX = static_cast<std::size_t>(-1);
+
+
+StreamSender::StreamSender(const std::vector<const FrameSlot*>& streams, const StreamSettings& settings, 
+						AdmissionControl& admissionControl, std::mutex& outMutex,
+						TranscoderPool* transcoder/* = nullptr*/)
+	: _streams(streams.size())
+	, _settings(settings)
+	, _admissionControl(admissionControl)
+	, _outMutex(outMutex)
+	, _transcoder(transcoder)
+	, _clientsCount(0)
+{
+	for (std::size_t i = 0; i < streams.size(); i++)
+	{
+		assert(streams[i] != nullptr);
+		_streams[i].slot = streams[i];
+		_streams[i].metrics.reset(new StreamMetrics());
+	}
+}
+
+StreamSender::~StreamSender()
+{
+	if (_thread.joinable())
+	{
+		stop();
+	}
+}
+
+void StreamSender::start()
+{
+	if (_eventLoop)
+	{
+		throw std::logic_error("Stream sender already started.");
+	}
+	
+	std::unique_ptr<EventLoop> eventLoop(new EventLoop());
+	_frameEvent = eventLoop->createEvent();
+	_clientsEvent = eventLoop->createEvent();
+	_stopEvent = eventLoop->createEvent();
+	_eventLoop = std::move(eventLoop);
+	
+	_thread = std::thread(&StreamSender::eventLoop, this);
+}
+
+void StreamSender::stop()
+{
+	if (!_eventLoop)
+	{
+		return;
+	}
+	
+	EventLoop::signalEvent(_stopEvent);
+	
+	if (_thread.joinable())
+	{
+		_thread.join();
+	}
+	
+	for (const Client& client : _clients)
+	{
+		shutdown(client.sock, 2);
+		close(client.sock);
+		_admissionControl.release(client.address);
+	}
+	
+	{
+		std::lock_guard<std::mutex> lg(_newClientsMutex);
+		for (const NewClient& newClient : _newClients)
+		{
+			shutdown(newClient.sock, 2);
+			close(newClient.sock);
+			_admissionControl.release(newClient.address);
+		}
+		_newClients.clear();
+	}
+	
+	_clients.clear();
+	_clientsCount.store(0, std::memory_order_relaxed);
+	
+	{
+		std::lock_guard<std::mutex> lg(_clientMetricsMutex);
+		_clientMetrics.clear();
+	}
+
+	_eventLoop.reset();
+	_frameEvent = _clientsEvent = _stopEvent = -1;
+}
+
+void StreamSender::addClient(int sock, std::uint32_t address, std::size_t stream)
+{
+	addClient(sock, address, stream, Tier());
+}
+
+void StreamSender::addClient(int sock, std::uint32_t address, std::size_t stream, const Tier& tier)
+{
+	assert(_eventLoop);
+	assert(stream < _streams.size());
+	
+	{
+		std::lock_guard<std::mutex> lg(_newClientsMutex);
+		_newClients.push_back(NewClient{sock, address, stream, _transcoder != nullptr ? tier : Tier()});
+	}
+	
+	_clientsCount.fetch_add(1, std::memory_order_relaxed);
+	EventLoop::signalEvent(_clientsEvent);
+}
+
+void StreamSender::notifyFrame()
+{
+	if (_frameEvent != -1)
+	{
+		EventLoop::signalEvent(_frameEvent);
+	}
+}
+
+StreamStats StreamSender::streamStats() const
+{
+	StreamStats stats;
+	stats.sendCalls = _sendCalls.value();
+	stats.partialWrites = _partialWrites.value();
+	stats.sendErrors = _sendErrors.value();
+	stats.slowClientsDropped = _slowClientsDropped.value();
+	
+	stats.streams.resize(_streams.size());
+	for (std::size_t i = 0; i < _streams.size(); i++)
+	{
+		const StreamMetrics& metrics = *_streams[i].metrics;
+		StreamStats::Stream& stream = stats.streams[i];
+		stream.framesSent = metrics.framesSent.value();
+		stream.bytesSent = metrics.bytesSent.value();
+		stream.framesSkipped = metrics.framesSkipped.value();
+		stream.firstByteLatency = metrics.firstByteLatency.snapshot();
+		stream.sendDuration = metrics.sendDuration.snapshot();
+		stream.latency = metrics.latency.snapshot();
+		stats.framesSent += stream.framesSent;
+	}
+	
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	
+	std::lock_guard<std::mutex> lg(_clientMetricsMutex);
+	stats.clients.reserve(_clientMetrics.size());
+	for (const auto& kv : _clientMetrics)
+	{
+		const ClientMetrics& metrics = *kv.second;
+		StreamStats::Client client;
+		client.sock = metrics.sock;
+		client.address = metrics.address;
+		client.stream = metrics.stream;
+		client.tier = metrics.tier;
+		client.connected = now - metrics.connectedAt;
+		client.framesSent = metrics.framesSent.value();
+		client.bytesSent = metrics.bytesSent.value();
+		client.framesSkipped = metrics.framesSkipped.value();
+		stats.clients.push_back(client);
+	}
+	
+	return stats;
+}
+
+void StreamSender::eventLoop()
+{
+	try
+	{
+		bool stopRequested = false;
+		
+		while (!stopRequested)
+		{
+			const int n = _eventLoop->wait();
+			for (int i = 0; i < n; i++)
+			{
+				const struct epoll_event& event = _eventLoop->event(i);
+				const int fd = event.data.fd;
+				if (fd == _stopEvent)
+				{
+					stopRequested = true;
+				}
+				else if (fd == _frameEvent)
+				{
+					EventLoop::drainEvent(_frameEvent);
+					streamFrames();
+				}
+				else if (fd == _clientsEvent)
+				{
+					EventLoop::drainEvent(_clientsEvent);
+					takeNewClients();
+				}
+				else
+				{
+					handleClientEvent(fd, event.events);
+				}
+			}
+		}
+	}
+	catch (const std::exception& ex)
+	{
+		{
+			std::lock_guard<std::mutex> lg(_outMutex);
+			std::cerr << "Exception (stream sender): " << ex.what() << std::endl;
+		}
+	}
+	catch (...)
+	{
+		{
+			std::lock_guard<std::mutex> lg(_outMutex);
+			std::cerr << "Exception (stream sender): unknown." << std::endl;
+		}
+	}
+}
+
+void StreamSender::takeNewClients()
+{
+	std::vector<NewClient> newClients;
+	
+	{
+		std::lock_guard<std::mutex> lg(_newClientsMutex);
+		newClients.swap(_newClients);
+	}
+	
+	for (const NewClient& newClient : newClients)
+	{
+		const int sock = newClient.sock;
+		
+		// the stream is sent without blocking, the partially sent
+		// frames are resumed when the socket becomes writable
+		if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) == -1)
+		{
+			{
+				std::lock_guard<std::mutex> lg(_outMutex);
+				perror("fcntl()");
+			}
+			shutdown(sock, 2);
+			close(sock);
+			_admissionControl.release(newClient.address);
+			_clientsCount.fetch_sub(1, std::memory_order_relaxed);
+			continue;
+		}
+		
+		try
+		{
+			_eventLoop->add(sock, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+		}
+		catch (const std::exception& ex)
+		{
+			{
+				std::lock_guard<std::mutex> lg(_outMutex);
+				std::cerr << ex.what() << std::endl;
+			}
+			shutdown(sock, 2);
+			close(sock);
+			_admissionControl.release(newClient.address);
+			_clientsCount.fetch_sub(1, std::memory_order_relaxed);
+			continue;
+		}
+		
+		Client& client = _clients.add(sock);
+		client.address = newClient.address;
+		client.stream = newClient.stream;
+		client.tier = newClient.tier;
+		
+		std::unique_ptr<ClientMetrics> metrics(new ClientMetrics());
+		metrics->sock = sock;
+		metrics->address = newClient.address;
+		metrics->stream = newClient.stream;
+		metrics->tier = newClient.tier;
+		metrics->connectedAt = std::chrono::steady_clock::now();
+		client.metrics = metrics.get();
+		
+		{
+			std::lock_guard<std::mutex> lg(_clientMetricsMutex);
+			_clientMetrics[sock] = std::move(metrics);
+		}
+		
+#if MJPEG_SERVER_ZEROCOPY
+		const int one = 1;
+		client.zeroCopy = _settings.zeroCopy 
+			&& setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+#endif
+		
+		// the new client gets the latest frame immediately
+		std::uint64_t sequence = 0;
+		std::chrono::steady_clock::time_point publishedAt;
+		const FramePtr frame = _streams[client.stream].slot->latest(sequence, publishedAt);
+		if (frame && !offerFrame(client, frame, sequence, publishedAt))
+		{
+			dropClient(sock);
+		}
+	}
+}
+
+void StreamSender::handleClientEvent(int sock, unsigned events)
+{
+	Client* client = _clients.find(sock);
+	if (client == nullptr)
+	{
+		return;
+	}
+	
+	// the client is receiving the stream, it's not expected to send anything.
+	// drop the client when it closes the connection.
+	bool lost = (events & (EPOLLRDHUP | EPOLLHUP)) != 0;
+	
+	// the completions of MSG_ZEROCOPY sends are reported via error queue
+	if (!lost && (events & EPOLLERR) != 0)
+	{
+		lost = !readErrorQueue(*client);
+	}
+	
+	char buffer[512];
+	while (!lost && (events & EPOLLIN) != 0)
+	{
+		int nbytes = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+		if (nbytes == 0 || (nbytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+		{
+			lost = true;
+		}
+		else if (nbytes < 0)
+		{
+			break;
+		}
+	}
+	
+	if (!lost && (events & EPOLLOUT) != 0)
+	{
+		client->writable = true;
+		lost = !flushClient(*client);
+	}
+	
+	if (lost)
+	{
+		{
+			std::lock_guard<std::mutex> lg(_outMutex);
+			std::cout << "Client disconnected (sock " << sock << ")." << std::endl;
+		}
+		
+		dropClient(sock);
+	}
+}
+
+void StreamSender::streamFrames()
+{
+	// the latest frame of every stream is taken once per wake up
+	struct Latest
+	{
+		FramePtr frame;
+		std::uint64_t sequence = 0;
+		std::chrono::steady_clock::time_point publishedAt;
+	};
+	
+	std::vector<Latest> latest(_streams.size());
+	for (std::size_t i = 0; i < _streams.size(); i++)
+	{
+		latest[i].frame = _streams[i].slot->latest(latest[i].sequence, latest[i].publishedAt);
+	}
+	
+	std::vector<int> lostClients;
+	
+	for (std::size_t i = 0; i < _clients.size(); i++)
+	{
+		Client& client = _clients[i];
+		const Latest& l = latest[client.stream];
+		if (l.frame && !offerFrame(client, l.frame, l.sequence, l.publishedAt))
+		{
+			lostClients.push_back(client.sock);
+		}
+	}
+	
+	for (int s : lostClients)
+	{
+		dropClient(s);
+	}
+}
+
+bool StreamSender::offerFrame(Client& client, const FramePtr& frame, std::uint64_t sequence, 
+							std::chrono::steady_clock::time_point publishedAt)
+{
+	if (client.tier.original())
+	{
+		return sendFrame(client, frame, sequence, publishedAt);
+	}
+	
+	const FramePtr variant = tierFrame(client, frame, sequence, publishedAt);
+	if (variant)
+	{
+		return sendFrame(client, variant, sequence, publishedAt);
+	}
+	
+	// the busy client only checks the backlog, the frame 
+	// being sent estimates the size of the skipped ones
+	return !client.frame || sendFrame(client, client.frame, sequence, publishedAt);
+}
+
+FramePtr StreamSender::tierFrame(Client& client, const FramePtr& frame, std::uint64_t& sequence, 
+								std::chrono::steady_clock::time_point& publishedAt)
+{
+	// the next frame is transcoded while the previous one is being sent.
+	// the client waits for it, even if newer frames are published meanwhile, 
+	// so the client of a tier receives the frames as fast as they are transcoded.
+	if (!client.pending && frame && sequence > client.sequence)
+	{
+		client.pending = frame;
+		client.pendingSequence = sequence;
+		client.pendingPublishedAt = publishedAt;
+		_transcoder->request(frame, client.tier);
+	}
+	
+	FramePtr variant;
+	if (client.frame || !client.pending || !client.pending->findVariant(client.tier.key(), variant))
+	{
+		return nullptr;
+	}
+	
+	sequence = client.pendingSequence;
+	publishedAt = client.pendingPublishedAt;
+	client.pending.reset();
+	
+	if (!variant)
+	{
+		// could not be transcoded, the next published frame is requested
+		client.sequence = sequence;
+	}
+	
+	return variant;
+}
+
+bool StreamSender::sendFrame(Client& client, const FramePtr& frame, std::uint64_t sequence, 
+							std::chrono::steady_clock::time_point publishedAt)
+{
+	if (sequence <= client.sequence)
+	{
+		return true;
+	}
+	
+	if (client.frame)
+	{
+		const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		
+		// the client is busy with the previous frame, 
+		// it jumps to the latest one when done
+		if (_settings.slowClientPolicy == SlowClientPolicy::Disconnect
+			&& ((sequence - client.sequence) * frame->size() > _settings.maxBacklogBytes
+				|| now - client.startedAt > _settings.maxBacklogTime))
+		{
+			_slowClientsDropped.add();
+			
+			std::lock_guard<std::mutex> lg(_outMutex);
+			std::cerr << "Client (sock " << client.sock << ") is too slow, "
+				<< (sequence - client.sequence) << " frames are not sent." << std::endl;
+			return false;
+		}
+		
+		return true;
+	}
+	
+	startFrame(client, frame, sequence, publishedAt);
+	return flushClient(client);
+}
+
+void StreamSender::startFrame(Client& client, const FramePtr& frame, std::uint64_t sequence, 
+							std::chrono::steady_clock::time_point publishedAt)
+{
+	// the frames published while the previous one was being sent are skipped
+	if (client.sequence != 0 && sequence > client.sequence + 1)
+	{
+		const std::uint64_t skipped = sequence - client.sequence - 1;
+		client.metrics->framesSkipped.add(skipped);
+		_streams[client.stream].metrics->framesSkipped.add(skipped);
+	}
+	
+	client.frame = frame;
+	client.sequence = sequence;
+	client.publishedAt = publishedAt;
+	client.startedAt = std::chrono::steady_clock::now();
+	client.header = partHeader(client.stream, frame, sequence);
+	client.offset = 0;
+}
+
+bool StreamSender::flushClient(Client& client)
+{
+	while (client.writable && client.frame)
+	{
+		const Frame& payload = *client.frame;
+		const std::string& header = *client.header;
+		
+		// the rest of the part header and the payload by single call
+		struct iovec iov[2];
+		int iovcnt = 0;
+		
+		std::size_t offset = client.offset;
+		if (offset < header.length())
+		{
+			iov[iovcnt].iov_base = const_cast<char*>(header.data() + offset);
+			iov[iovcnt].iov_len = header.length() - offset;
+			iovcnt += 1;
+			offset = 0;
+		}
+		else
+		{
+			offset -= header.length();
+		}
+		
+		iov[iovcnt].iov_base = const_cast<unsigned char*>(payload.data() + offset);
+		iov[iovcnt].iov_len = payload.size() - offset;
+		iovcnt += 1;
+		
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		
+		int flags = MSG_NOSIGNAL;
+		
+#if MJPEG_SERVER_ZEROCOPY
+		const bool zeroCopy = client.zeroCopy && payload.size() >= _settings.zeroCopyMinFrameSize;
+		if (zeroCopy)
+		{
+			flags |= MSG_ZEROCOPY;
+		}
+#endif
+		
+		ssize_t nbytes = sendmsg(client.sock, &msg, flags);
+		_sendCalls.add();
+		
+		if (nbytes < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				// resume when the socket becomes writable (EPOLLOUT)
+				client.writable = false;
+				return true;
+			}
+			
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			
+#if MJPEG_SERVER_ZEROCOPY
+			if (errno == ENOBUFS && zeroCopy)
+			{
+				// the limit of locked memory is reached, fall back to copying
+				client.zeroCopy = false;
+				continue;
+			}
+#endif
+			
+			_sendErrors.add();
+			
+			std::lock_guard<std::mutex> lg(_outMutex);
+			perror("sendmsg()");
+			std::cerr << "Could not send data to client's socket." << std::endl;
+			return false;
+		}
+		
+		StreamMetrics& streamMetrics = *_streams[client.stream].metrics;
+		streamMetrics.bytesSent.add(nbytes);
+		client.metrics->bytesSent.add(nbytes);
+		
+		const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (client.offset == 0 && nbytes > 0)
+		{
+			client.firstByteAt = now;
+			streamMetrics.firstByteLatency.observe(
+				std::chrono::duration_cast<std::chrono::microseconds>(now - client.publishedAt));
+		}
+		
+		if (static_cast<std::size_t>(nbytes) < header.length() + payload.size() - client.offset)
+		{
+			_partialWrites.add();
+		}
+		
+#if MJPEG_SERVER_ZEROCOPY
+		if (zeroCopy)
+		{
+			// the kernel numbers the zerocopy sends sequentially
+			const std::uint32_t id = client.zeroCopyNextId++;
+			if (!client.zeroCopyPending.empty() 
+				&& client.zeroCopyPending.back().frame == client.frame)
+			{
+				client.zeroCopyPending.back().id = id;
+			}
+			else
+			{
+				ZeroCopySend zeroCopySend;
+				zeroCopySend.id = id;
+				zeroCopySend.frame = client.frame;
+				zeroCopySend.header = client.header;
+				client.zeroCopyPending.push_back(std::move(zeroCopySend));
+			}
+		}
+#endif
+		
+		client.offset += nbytes;
+		if (client.offset == header.length() + payload.size())
+		{
+			streamMetrics.framesSent.add();
+			streamMetrics.sendDuration.observe(
+				std::chrono::duration_cast<std::chrono::microseconds>(now - client.firstByteAt));
+			streamMetrics.latency.observe(
+				std::chrono::duration_cast<std::chrono::microseconds>(now - payload.capturedAt()));
+			client.metrics->framesSent.add();
+			client.frame.reset();
+			
+			// jump to the frame published while this one was being sent,
+			// or to the pending one, if it's transcoded already
+			std::uint64_t sequence = 0;
+			std::chrono::steady_clock::time_point publishedAt;
+			FramePtr frame = _streams[client.stream].slot->latest(sequence, publishedAt);
+			if (!client.tier.original())
+			{
+				frame = tierFrame(client, frame, sequence, publishedAt);
+			}
+			
+			if (frame && sequence > client.sequence)
+			{
+				startFrame(client, frame, sequence, publishedAt);
+			}
+		}
+	}
+	
+	return true;
+}
+
+bool StreamSender::readErrorQueue(Client& client)
+{
+#if MJPEG_SERVER_ZEROCOPY
+	while (client.zeroCopy || !client.zeroCopyPending.empty())
+	{
+		char control[128];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		
+		if (recvmsg(client.sock, &msg, MSG_ERRQUEUE) == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				break;
+			}
+			
+			std::lock_guard<std::mutex> lg(_outMutex);
+			perror("recvmsg()");
+			return false;
+		}
+		
+		for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+				|| (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+			{
+				continue;
+			}
+			
+			const struct sock_extended_err* serr = 
+				reinterpret_cast<const struct sock_extended_err*>(CMSG_DATA(cm));
+			if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+			{
+				return false;
+			}
+			
+			// the sends [ee_info, ee_data] are completed, release their data
+			const std::uint32_t last = serr->ee_data;
+			while (!client.zeroCopyPending.empty() 
+				&& static_cast<std::int32_t>(client.zeroCopyPending.front().id - last) <= 0)
+			{
+				client.zeroCopyPending.pop_front();
+			}
+		}
+	}
+#endif
+	
+	// the error queue doesn't explain the error, it's a socket failure
+	int error = 0;
+	socklen_t len = sizeof(error);
+	if (getsockopt(client.sock, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0)
+	{
+		return false;
+	}
+	
+	return true;
+}
+
+StreamSender::PartHeader StreamSender::partHeader(std::size_t stream, 
+										const FramePtr& frame, std::uint64_t sequence)
+{
+	// the part header is built once per frame and shared by the clients of the stream
+	Stream& s = _streams[stream];
+	if (!s.partHeader || s.partHeaderSequence != sequence || s.partHeaderFrameSize != frame->size())
+	{
+		std::string header(
+			"--mjpegstream\r\n"
+			"Content-Type: image/jpeg\r\n"
+			"Content-Length: ");
+		header += std::to_string(frame->size());
+		header += "\r\n";
+		
+		if (_settings.frameHeaders)
+		{
+			// the capture time by the wall clock, so the client can compare it with own
+			const std::chrono::system_clock::time_point capturedAt = std::chrono::system_clock::now()
+				- std::chrono::duration_cast<std::chrono::system_clock::duration>(
+					std::chrono::steady_clock::now() - frame->capturedAt());
+			const long long us = std::chrono::duration_cast<std::chrono::microseconds>(
+				capturedAt.time_since_epoch()).count();
+			
+			char timestamp[32];
+			snprintf(timestamp, sizeof(timestamp), "%lld.%06lld", us / 1000000, us % 1000000);
+			header += "X-Timestamp: ";
+			header += timestamp;
+			
+			// the stream sequence unless the source numbers the frames
+			header += "\r\nX-Frame-Seq: ";
+			header += std::to_string(frame->hasCaptureSequence() ? frame->captureSequence() : sequence);
+			header += "\r\n";
+		}
+		
+		header += "\r\n";
+		
+		s.partHeader = std::make_shared<const std::string>(std::move(header));
+		s.partHeaderSequence = sequence;
+		s.partHeaderFrameSize = frame->size();
+	}
+	
+	return s.partHeader;
+}
+
+void StreamSender::dropClient(int sock)
+{
+	const Client* client = _clients.find(sock);
+	if (client == nullptr)
+	{
+		return;
+	}
+	
+	_admissionControl.release(client->address);
+	_clients.remove(sock);
+	
+	{
+		std::lock_guard<std::mutex> lg(_clientMetricsMutex);
+		_clientMetrics.erase(sock);
+	}
+
+	_clientsCount.fetch_sub(1, std::memory_order_relaxed);
+	
+	// closing the descriptor removes it from the epoll set as well
+	shutdown(sock, 2);
+	close(sock);
+}
+
+
+StreamStats& StreamStats::operator+=(const StreamStats& other)
+{
+	framesSent += other.framesSent;
+	sendCalls += other.sendCalls;
+	partialWrites += other.partialWrites;
+	sendErrors += other.sendErrors;
+	slowClientsDropped += other.slowClientsDropped;
+	
+	if (streams.size() < other.streams.size())
+	{
+		streams.resize(other.streams.size());
+	}
+	
+	for (std::size_t i = 0; i < other.streams.size(); i++)
+	{
+		streams[i].framesSent += other.streams[i].framesSent;
+		streams[i].bytesSent += other.streams[i].bytesSent;
+		streams[i].framesSkipped += other.streams[i].framesSkipped;
+		streams[i].firstByteLatency += other.streams[i].firstByteLatency;
+		streams[i].sendDuration += other.streams[i].sendDuration;
+		streams[i].latency += other.streams[i].latency;
+	}
+	
+	clients.insert(clients.end(), other.clients.begin(), other.clients.end());
+	return *this;
+}
+
+
+StreamSender::Client& StreamSender::ClientRegistry::add(int sock)
+{
+	assert(sock >= 0);
+	
+	const std::size_t fd = static_cast<std::size_t>(sock);
+	if (fd >= _indexes.size())
+	{
+		_indexes.resize(fd + 1, NO_INDEX);
+	}
+	
+	assert(_indexes[fd] == NO_INDEX);
+	
+	_indexes[fd] = _clients.size();
+	_clients.emplace_back();
+	_clients.back().sock = sock;
+	
+	return _clients.back();
+}
+
+void StreamSender::ClientRegistry::remove(int sock)
+{
+	const std::size_t fd = static_cast<std::size_t>(sock);
+	if (fd >= _indexes.size() || _indexes[fd] == NO_INDEX)
+	{
+		return;
+	}
+	
+	// move the last client to the place of removed one
+	const std::size_t i = _indexes[fd];
+	if (i != _clients.size() - 1)
+	{
+		_clients[i] = std::move(_clients.back());
+		_indexes[_clients[i].sock] = i;
+	}
+	
+	_clients.pop_back();
+	_indexes[fd] = NO_INDEX;
+}
+
+StreamSender::Client* StreamSender::ClientRegistry::find(int sock)
+{
+	const std::size_t fd = static_cast<std::size_t>(sock);
+	if (fd >= _indexes.size() || _indexes[fd] == NO_INDEX)
+	{
+		return nullptr;
+	}
+	
+	return &_clients[_indexes[fd]];
+}
+
+void StreamSender::ClientRegistry::clear()
+{
+	_clients.clear();
+	_indexes.clear();
+}
@@ -0,0 +1,298 @@
+#pragma once
+
+#include "admission-control.h"
+#include "event-loop.h"
+#include "frame.h"
+#include "metrics.h"
+#include "transcoder-pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+// what to do with a client which does not keep up with the stream
+enum class SlowClientPolicy
+{
+	SkipFrames,	// skip the frames published while sending, jump to the latest one
+	Disconnect	// disconnect when the skipped frames exceed the backlog limit
+};
+
+struct StreamSettings
+{
+	// the backlog limits are applied with SlowClientPolicy::Disconnect only.
+	// the backlog is the time spent on sending the current frame and
+	// the size of the frames published meanwhile.
+	SlowClientPolicy slowClientPolicy = SlowClientPolicy::SkipFrames;
+	std::chrono::milliseconds maxBacklogTime = std::chrono::milliseconds(2000);
+	std::size_t maxBacklogBytes = 8 * 1024 * 1024;
+	
+	// send the frames not smaller than zeroCopyMinFrameSize with MSG_ZEROCOPY
+	bool zeroCopy = false;
+	std::size_t zeroCopyMinFrameSize = 32 * 1024;
+	
+	// add X-Timestamp (capture time, seconds since the epoch) and 
+	// X-Frame-Seq (the source sequence number) headers to every part
+	bool frameHeaders = false;
+};
+
+// the counters of the stream sending
+struct StreamStats
+{
+	// the counters of a stream
+	struct Stream
+	{
+		std::uint64_t framesSent = 0;
+		std::uint64_t bytesSent = 0;
+		std::uint64_t framesSkipped = 0;	// published while the client was busy
+		Histogram::Snapshot firstByteLatency;	// from the publishing until the first byte is sent
+		Histogram::Snapshot sendDuration;	// from the first byte until the last one is sent
+		Histogram::Snapshot latency;	// from the capture until the last byte is sent
+	};
+	
+	// the counters of a connected client
+	struct Client
+	{
+		int sock = -1;
+		std::uint32_t address = 0;
+		std::size_t stream = 0;
+		JpegTranscoder::Tier tier;
+		std::chrono::steady_clock::duration connected;
+		std::uint64_t framesSent = 0;
+		std::uint64_t bytesSent = 0;
+		std::uint64_t framesSkipped = 0;
+	};
+	
+	std::uint64_t framesSent = 0;	// frames completely sent to a client
+	std::uint64_t sendCalls = 0;	// send/sendmsg syscalls
+	std::uint64_t partialWrites = 0;	// sends which did not take all the data
+	std::uint64_t sendErrors = 0;
+	std::uint64_t slowClientsDropped = 0;
+	
+	std::vector<Stream> streams;
+	std::vector<Client> clients;
+	
+	// merge the stats of another sender
+	StreamStats& operator+=(const StreamStats& other);
+};
+
+
+// Sends the multipart streams to its shard of the clients. Every sender 
+// has own thread and event loop, the frames are taken from the shared slots,
+// one per stream. The client receives the stream it's added with, either
+// the frames as published or their variants transcoded to the tier.
+class StreamSender final
+{
+public:
+	using Tier = JpegTranscoder::Tier;
+	
+public:
+	StreamSender(const StreamSender&) = delete;
+	StreamSender& operator=(const StreamSender&) = delete;
+	
+	// the slots and the transcoder should outlive the sender. without 
+	// the transcoder the clients receive the frames as published.
+	StreamSender(const std::vector<const FrameSlot*>& streams, const StreamSettings& settings, 
+				AdmissionControl& admissionControl, std::mutex& outMutex,
+				TranscoderPool* transcoder = nullptr);
+	~StreamSender();
+	
+	void start();
+	void stop();
+	
+	// take over the socket of authorized client of the stream (thread-safe).
+	// the address is released in admission control, when the client is dropped.
+	void addClient(int sock, std::uint32_t address, std::size_t stream);
+	// the client of the tier, see TranscoderPool
+	void addClient(int sock, std::uint32_t address, std::size_t stream, const Tier& tier);
+	
+	// wake up the sender, the new frame is published to any stream 
+	// or transcoded (thread-safe)
+	void notifyFrame();
+	
+	std::size_t clientsCount() const
+	{
+		return _clientsCount.load(std::memory_order_relaxed);
+	}
+	
+	// the counters are written by the sender thread only,
+	// so collecting them does not slow the stream down
+	StreamStats streamStats() const;
+	
+private:
+	using PartHeader = std::shared_ptr<const std::string>;
+	
+	// the data passed to MSG_ZEROCOPY send should not be released 
+	// until the kernel notifies about completion of the send with this id
+	struct ZeroCopySend
+	{
+		std::uint32_t id = 0;
+		FramePtr frame;
+		PartHeader header;
+	};
+	
+	struct ClientMetrics
+	{
+		int sock = -1;
+		std::uint32_t address = 0;
+		std::size_t stream = 0;
+		Tier tier;
+		std::chrono::steady_clock::time_point connectedAt;
+		Counter framesSent;
+		Counter bytesSent;
+		Counter framesSkipped;
+	};
+	
+	// the client receiving the stream. offset points to the first 
+	// unsent byte of the part (header + frame) being sent.
+	// the client of a tier waits for the pending frame to be transcoded.
+	struct Client
+	{
+		int sock = -1;
+		std::uint32_t address = 0;
+		std::size_t stream = 0;
+		Tier tier;
+		ClientMetrics* metrics = nullptr;
+		FramePtr frame;
+		std::uint64_t sequence = 0;	// of the frame being sent or sent last
+		std::chrono::steady_clock::time_point publishedAt;
+		std::chrono::steady_clock::time_point startedAt;
+		std::chrono::steady_clock::time_point firstByteAt;
+		PartHeader header;
+		std::size_t offset = 0;
+		bool writable = true;
+		
+		FramePtr pending;
+		std::uint64_t pendingSequence = 0;
+		std::chrono::steady_clock::time_point pendingPublishedAt;
+		
+		bool zeroCopy = false;
+		std::uint32_t zeroCopyNextId = 0;
+		std::deque<ZeroCopySend> zeroCopyPending;
+	};
+	
+	// the clients are stored densely for fan-out and indexed by socket,
+	// so lookup, insertion and removal are O(1)
+	class ClientRegistry
+	{
+	public:
+		Client& add(int sock);
+		void remove(int sock);
+		Client* find(int sock);
+		void clear();
+		
+		std::size_t size() const
+		{
+			return _clients.size();
+		}
+		
+		Client& operator[](std::size_t i)
+		{
+			return _clients[i];
+		}
+		
+		std::vector<Client>::const_iterator begin() const
+		{
+			return _clients.cbegin();
+		}
+		
+		std::vector<Client>::const_iterator end() const
+		{
+			return _clients.cend();
+		}
+		
+	private:
+		static const std::size_t NO_INDEX;
+		
+		std::vector<Client> _clients;
+		std::vector<std::size_t> _indexes;	// socket -> position in _clients
+	};
+	
+	struct NewClient
+	{
+		int sock;
+		std::uint32_t address;
+		std::size_t stream;
+		Tier tier;
+	};
+	
+	struct StreamMetrics
+	{
+		Counter framesSent;
+		Counter bytesSent;
+		Counter framesSkipped;
+		Histogram firstByteLatency;
+		Histogram sendDuration;
+		Histogram latency;
+	};
+	
+	// the stream and the part header of its latest frame. the variants 
+	// of the frame have the same header except the length.
+	struct Stream
+	{
+		const FrameSlot* slot = nullptr;
+		PartHeader partHeader;
+		std::uint64_t partHeaderSequence = 0;
+		std::size_t partHeaderFrameSize = 0;
+		std::unique_ptr<StreamMetrics> metrics;
+	};
+	
+private:
+	void eventLoop();
+	void takeNewClients();
+	void handleClientEvent(int sock, unsigned events);
+	void streamFrames();
+	// send the frame of the stream, or its variant to the client of a tier
+	bool offerFrame(Client& client, const FramePtr& frame, std::uint64_t sequence, 
+					std::chrono::steady_clock::time_point publishedAt);
+	bool sendFrame(Client& client, const FramePtr& frame, std::uint64_t sequence, 
+				std::chrono::steady_clock::time_point publishedAt);
+	// request the frame for the client of a tier unless it waits for another one.
+	// return the variant of the pending frame, once it's transcoded and the client 
+	// is not busy, the sequence and the publishing time are of the pending frame.
+	FramePtr tierFrame(Client& client, const FramePtr& frame, std::uint64_t& sequence, 
+					std::chrono::steady_clock::time_point& publishedAt);
+	void startFrame(Client& client, const FramePtr& frame, std::uint64_t sequence, 
+					std::chrono::steady_clock::time_point publishedAt);
+	bool flushClient(Client& client);
+	bool readErrorQueue(Client& client);
+	PartHeader partHeader(std::size_t stream, const FramePtr& frame, std::uint64_t sequence);
+	void dropClient(int sock);
+	
+private:
+	std::vector<Stream> _streams;
+	const StreamSettings _settings;
+	AdmissionControl& _admissionControl;
+	std::mutex& _outMutex;
+	TranscoderPool* _transcoder = nullptr;
+	
+	std::unique_ptr<EventLoop> _eventLoop;
+	int _frameEvent = -1;	// signaled by notifyFrame()
+	int _clientsEvent = -1;	// signaled by addClient()
+	int _stopEvent = -1;	// signaled by stop()
+	
+	std::mutex _newClientsMutex;
+	std::vector<NewClient> _newClients;
+	
+	ClientRegistry _clients;
+	std::atomic<std::size_t> _clientsCount;
+	
+	Counter _sendCalls;
+	Counter _partialWrites;
+	Counter _sendErrors;
+	Counter _slowClientsDropped;
+	
+	// the metrics of the connected clients by socket, the mutex 
+	// is locked only when a client is added or dropped
+	mutable std::mutex _clientMetricsMutex;
+	std::unordered_map<int, std::unique_ptr<ClientMetrics>> _clientMetrics;
+	
+	std::thread _thread;
+};
@@ -0,0 +1,161 @@
+#include "transcoder-pool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <stdexcept>
+
+
+TranscoderPool::TranscoderPool(std::size_t threadsCount, std::mutex& outMutex, Notify notify)
+	: _outMutex(outMutex)
+	, _notify(std::move(notify))
+{
+	assert(_notify);
+	
+	for (std::size_t i = 0; i < std::max<std::size_t>(threadsCount, 1); i++)
+	{
+		_transcoders.emplace_back(new JpegTranscoder());
+	}
+}
+
+TranscoderPool::~TranscoderPool()
+{
+	stop();
+}
+
+void TranscoderPool::start()
+{
+	if (!_threads.empty())
+	{
+		throw std::logic_error("Transcoder pool already started.");
+	}
+	
+	_stopRequested = false;
+	for (std::unique_ptr<JpegTranscoder>& transcoder : _transcoders)
+	{
+		_threads.emplace_back(&TranscoderPool::transcodeLoop, this, std::ref(*transcoder));
+	}
+}
+
+void TranscoderPool::stop()
+{
+	{
+		std::lock_guard<std::mutex> lg(_queueMutex);
+		_stopRequested = true;
+		_queue.clear();
+	}
+	_queueCondition.notify_all();
+	
+	for (std::thread& thread : _threads)
+	{
+		thread.join();
+	}
+	_threads.clear();
+}
+
+void TranscoderPool::request(const FramePtr& frame, const Tier& tier)
+{
+	assert(frame && !tier.original());
+	
+	const std::uint32_t key = tier.key();
+	FramePtr variant;
+	if (frame->findVariant(key, variant))
+	{
+		return;
+	}
+	
+	{
+		std::lock_guard<std::mutex> lg(_queueMutex);
+		if (_stopRequested || pending(frame.get(), key))
+		{
+			return;
+		}
+		
+		Request r;
+		r.frame = frame;
+		r.key = key;
+		r.tier = tier;
+		_queue.push_back(std::move(r));
+	}
+	_queueCondition.notify_one();
+}
+
+bool TranscoderPool::pending(const Frame* frame, std::uint32_t key) const
+{
+	for (const Request& r : _queue)
+	{
+		if (r.frame.get() == frame && r.key == key)
+		{
+			return true;
+		}
+	}
+	
+	for (const Request& r : _active)
+	{
+		if (r.frame.get() == frame && r.key == key)
+		{
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+void TranscoderPool::transcodeLoop(JpegTranscoder& transcoder)
+{
+	while (true)
+	{
+		Request r;
+		
+		{
+			std::unique_lock<std::mutex> lock(_queueMutex);
+			_queueCondition.wait(lock,
+				[this]()
+				{
+					return _stopRequested || !_queue.empty();
+				});
+			
+			if (_stopRequested)
+			{
+				return;
+			}
+			
+			r = std::move(_queue.front());
+			_queue.pop_front();
+			_active.push_back(r);
+		}
+		
+		FramePtr variant;
+		try
+		{
+			variant = transcoder.transcode(*r.frame, r.tier);
+			_framesTranscoded.fetch_add(1, std::memory_order_relaxed);
+		}
+		catch (const std::exception& ex)
+		{
+			// a broken source fails every frame, only the first error is logged
+			if (_transcodeErrors.fetch_add(1, std::memory_order_relaxed) == 0)
+			{
+				std::lock_guard<std::mutex> lg(_outMutex);
+				std::cerr << "Exception (transcoder): " << ex.what() 
+					<< " The further errors are only counted." << std::endl;
+			}
+		}
+		
+		// cached before it's not pending, so it's never requested twice
+		r.frame->addVariant(r.key, std::move(variant));
+		
+		{
+			std::lock_guard<std::mutex> lg(_queueMutex);
+			std::vector<Request>::iterator it = std::find_if(_active.begin(), _active.end(),
+				[&r](const Request& a)
+				{
+					return a.frame == r.frame && a.key == r.key;
+				});
+			assert(it != _active.end());
+			_active.erase(it);
+		}
+		
+		_notify();
+	}
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "frame.h"
+#include "jpeg-transcoder.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Transcodes the frames to the tiers the clients ask for, by the pool
+// of threads, every one with own transcoder. The transcoded frame is cached
+// in the source frame (see Frame::addVariant), so the frame is transcoded
+// once per tier however many clients of the tier there are, and only
+// when they ask, so the tiers nobody watches cost nothing. Nothing is
+// dropped, the client of a tier asks for the next frame once it gets
+// the previous one, so there are no more requests than the clients.
+class TranscoderPool final
+{
+public:
+	using Tier = JpegTranscoder::Tier;
+	
+	// called by the transcoding threads, when the variant is cached
+	using Notify = std::function<void ()>;
+	
+public:
+	TranscoderPool(const TranscoderPool&) = delete;
+	TranscoderPool& operator=(const TranscoderPool&) = delete;
+	
+	// throw if the transcoder can't be created (e.g. no libjpeg).
+	// the errors are written to std::cerr under the output mutex.
+	TranscoderPool(std::size_t threadsCount, std::mutex& outMutex, Notify notify);
+	~TranscoderPool();
+	
+	void start();
+	// the waiting requests are dropped
+	void stop();
+	
+	// queue the frame unless it's transcoded or queued already (thread-safe)
+	void request(const FramePtr& frame, const Tier& tier);
+	
+	std::uint64_t framesTranscoded() const
+	{
+		return _framesTranscoded.load(std::memory_order_relaxed);
+	}
+	
+	std::uint64_t transcodeErrors() const
+	{
+		return _transcodeErrors.load(std::memory_order_relaxed);
+	}
+	
+private:
+	struct Request
+	{
+		FramePtr frame;
+		std::uint32_t key = 0;
+		Tier tier;
+	};
+	
+	void transcodeLoop(JpegTranscoder& transcoder);
+	// the request is queued or being transcoded
+	bool pending(const Frame* frame, std::uint32_t key) const;
+	
+private:
+	std::vector<std::unique_ptr<JpegTranscoder>> _transcoders;
+	std::vector<std::thread> _threads;
+	std::mutex& _outMutex;
+	Notify _notify;
+	
+	std::mutex _queueMutex;
+	std::condition_variable _queueCondition;
+	std::deque<Request> _queue;
+	std::vector<Request> _active;	// being transcoded
+	bool _stopRequested = false;
+	
+	std::atomic<std::uint64_t> _framesTranscoded{0};
+	std::atomic<std::uint64_t> _transcodeErrors{0};
+};
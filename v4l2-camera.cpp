@@ -1,27 +1,262 @@
 #include "v4l2-camera.h"
 
 #include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cmath>
 #include <cstring>
 
 #include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <stdexcept>
 
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/select.h>
 
 #include <unistd.h>
 
+#include <linux/dma-buf.h>
 #include <linux/videodev2.h>
 
 
+const unsigned V4L2Camera::DEFAULT_BUFFERS_COUNT = 4;
+const std::uint32_t V4L2Camera::DEFAULT_WIDTH = 640;
+const std::uint32_t V4L2Camera::DEFAULT_HEIGHT = 480;
+
+
+namespace
+{
+
+// the formats not listed are compressed
+double bitsPerPixel(std::uint32_t pixelFormat)
+{
+	switch (pixelFormat)
+	{
+	case V4L2_PIX_FMT_GREY:
+		return 8;
+		
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV21:
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YVU420:
+		return 12;
+		
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_YVYU:
+	case V4L2_PIX_FMT_UYVY:
+	case V4L2_PIX_FMT_VYUY:
+	case V4L2_PIX_FMT_NV16:
+	case V4L2_PIX_FMT_RGB565:
+		return 16;
+		
+	case V4L2_PIX_FMT_RGB24:
+	case V4L2_PIX_FMT_BGR24:
+		return 24;
+		
+	case V4L2_PIX_FMT_RGB32:
+	case V4L2_PIX_FMT_BGR32:
+		return 32;
+		
+	default:
+		return 2;
+	}
+}
+
+}
+
+
+double V4L2Camera::CaptureMode::fps() const
+{
+	return intervalNumerator != 0 ? static_cast<double>(intervalDenominator) / intervalNumerator : 0.0;
+}
+
+void V4L2Camera::CaptureMode::setFps(double fps)
+{
+	intervalNumerator = fps > 0 ? 1000 : 0;
+	intervalDenominator = fps > 0 ? static_cast<std::uint32_t>(std::lround(fps * 1000)) : 0;
+}
+
+std::string V4L2Camera::CaptureMode::format() const
+{
+	std::string fourcc;
+	for (int i = 0; i < 4; i++)
+	{
+		const char c = static_cast<char>((pixelFormat >> (8 * i)) & 0xFF);
+		if (c != '\0' && c != ' ')
+		{
+			fourcc += c;
+		}
+	}
+	return fourcc;
+}
+
+double V4L2Camera::CaptureMode::bitrate() const
+{
+	return static_cast<double>(width) * height * bitsPerPixel(pixelFormat) * fps();
+}
+
+
+// capture buffers are shared with the frames referring them,
+// so the memory stays valid until the last frame is released
+struct V4L2Camera::MappedBuffers
+{
+	struct Mapping
+	{
+		unsigned char* start = nullptr;
+		std::size_t length = 0;
+		int dmabufFd = -1;
+	};
+	
+	~MappedBuffers()
+	{
+		for (const Mapping& mapping : mappings)
+		{
+			if (ioMethod == IoMethod::UserPtr)
+			{
+				free(mapping.start);
+			}
+			else
+			{
+				munmap(mapping.start, mapping.length);
+			}
+			
+			if (mapping.dmabufFd != -1)
+			{
+				close(mapping.dmabufFd);
+			}
+		}
+		
+		for (unsigned char* spare : spares)
+		{
+			free(spare);
+		}
+	}
+	
+	void describe(unsigned index, struct v4l2_buffer& buf) const
+	{
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.index = index;
+		
+		if (ioMethod == IoMethod::UserPtr)
+		{
+			buf.memory = V4L2_MEMORY_USERPTR;
+			buf.m.userptr = reinterpret_cast<unsigned long>(mappings[index].start);
+			buf.length = mappings[index].length;
+		}
+		else
+		{
+			buf.memory = V4L2_MEMORY_MMAP;
+		}
+	}
+	
+	// the CPU reads of the exported buffer are bracketed,
+	// so the caches are coherent with the device
+	void syncAccess(unsigned index, bool start) const
+	{
+		const int dmabufFd = mappings[index].dmabufFd;
+		if (dmabufFd == -1)
+		{
+			return;
+		}
+		
+		struct dma_buf_sync sync = { 0 };
+		sync.flags = (start ? DMA_BUF_SYNC_START : DMA_BUF_SYNC_END) | DMA_BUF_SYNC_READ;
+		
+		int r = -1;
+		while ((r = ::ioctl(dmabufFd, DMA_BUF_IOCTL_SYNC, &sync)) == -1 && errno == EINTR)
+		{
+		}
+		
+		if (r == -1)
+		{
+			perror("ioctl()");
+		}
+	}
+	
+	// return buffer to driver, unless capturing is already stopped
+	void release(unsigned index)
+	{
+		std::lock_guard<std::mutex> lg(mutex);
+		held -= 1;
+		
+		syncAccess(index, false);
+		
+		if (fd != -1)
+		{
+			struct v4l2_buffer buf = { 0 };
+			describe(index, buf);
+			
+			int r = -1;
+			while ((r = ::ioctl(fd, VIDIOC_QBUF, &buf)) == -1 && errno == EINTR)
+			{
+			}
+			
+			if (r == -1)
+			{
+				perror("ioctl()");
+			}
+		}
+	}
+	
+	// user buffers only, nullptr if out of memory
+	unsigned char* takeSpare()
+	{
+		{
+			std::lock_guard<std::mutex> lg(mutex);
+			if (!spares.empty())
+			{
+				unsigned char* spare = spares.back();
+				spares.pop_back();
+				return spare;
+			}
+		}
+		
+		void* buffer = nullptr;
+		if (posix_memalign(&buffer, sysconf(_SC_PAGESIZE), bufferLength) != 0)
+		{
+			return nullptr;
+		}
+		
+		return static_cast<unsigned char*>(buffer);
+	}
+	
+	void recycle(unsigned char* buffer)
+	{
+		std::lock_guard<std::mutex> lg(mutex);
+		if (spares.size() < mappings.size())
+		{
+			spares.push_back(buffer);
+		}
+		else
+		{
+			free(buffer);
+		}
+	}
+	
+	IoMethod ioMethod = IoMethod::Mmap;
+	std::vector<Mapping> mappings;	// written by the capturing thread only
+	std::size_t bufferLength = 0;	// user buffers only
+	
+	std::mutex mutex;
+	int fd = -1;			// the device while capturing, -1 otherwise
+	std::size_t held = 0;	// buffers referred by frames (not user buffers)
+	std::vector<unsigned char*> spares;		// user buffers released by frames
+};
+
+
 V4L2Camera::~V4L2Camera()
 {
-	if (_bufferLength != 0)
+	// the driver should not fill the user buffers once they are freed
+	if (_isStreaming)
 	{
-		munmap(_buffer, _bufferLength);
+		enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		::ioctl(_fd, VIDIOC_STREAMOFF, &type);
 	}
+	
+	releaseBuffers();
 		
 	if (_fd != -1)
 	{
@@ -33,8 +268,16 @@ void V4L2Camera::openDevice(const char* deviceName)
 {
 	if (_fd != -1)
 	{
+		if (_isStreaming)
+		{
+			enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			::ioctl(_fd, VIDIOC_STREAMOFF, &type);
+		}
+		
+		releaseBuffers();
 		close(_fd);
 		_fd = -1;
+		_isStreaming = false;
 	}
 	
 	int fd = open(deviceName, O_RDWR);
@@ -108,97 +351,357 @@ void V4L2Camera::printCapabilities()
 }
 
 void V4L2Camera::setupCaptureFormat()
+{
+	setupCaptureFormat(CaptureMode());
+}
+
+void V4L2Camera::setupCaptureFormat(const CaptureMode& mode)
 {
 	struct v4l2_format fmt = { 0 };
 	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	fmt.fmt.pix.width = 640;
-	fmt.fmt.pix.height = 480;
-	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
+	fmt.fmt.pix.width = mode.width != 0 ? mode.width : DEFAULT_WIDTH;
+	fmt.fmt.pix.height = mode.height != 0 ? mode.height : DEFAULT_HEIGHT;
+	fmt.fmt.pix.pixelformat = mode.pixelFormat != 0 ? mode.pixelFormat : V4L2_PIX_FMT_MJPEG;
 	fmt.fmt.pix.field = V4L2_FIELD_NONE;
 	
+	const std::uint32_t requestedFormat = fmt.fmt.pix.pixelformat;
+	
 	if (V4L2Camera::ioctl(VIDIOC_S_FMT, &fmt) == -1)
 	{
 		throw std::runtime_error("Could not set capture format.");
 	}
 	
-	char fourcc[5] = { 0 };
-	strncpy(fourcc, (char*)&fmt.fmt.pix.pixelformat, 4);
+	_captureMode = CaptureMode();
+	_captureMode.width = fmt.fmt.pix.width;
+	_captureMode.height = fmt.fmt.pix.height;
+	_captureMode.pixelFormat = fmt.fmt.pix.pixelformat;
+	_captureMode.bytesPerLine = fmt.fmt.pix.bytesperline;
+	
+	// the driver keeps its frame rate, unless it's requested
+	struct v4l2_streamparm parm = { 0 };
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	
+	if (V4L2Camera::ioctl(VIDIOC_G_PARM, &parm) == 0)
+	{
+		if (mode.intervalNumerator != 0 && mode.intervalDenominator != 0)
+		{
+			if (parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)
+			{
+				parm.parm.capture.timeperframe.numerator = mode.intervalNumerator;
+				parm.parm.capture.timeperframe.denominator = mode.intervalDenominator;
+				
+				if (V4L2Camera::ioctl(VIDIOC_S_PARM, &parm) == -1)
+				{
+					throw std::runtime_error("Could not set capture frame rate.");
+				}
+			}
+			else
+			{
+				std::cout << "The device does not support setting the frame rate." << std::endl;
+			}
+		}
+		
+		_captureMode.intervalNumerator = parm.parm.capture.timeperframe.numerator;
+		_captureMode.intervalDenominator = parm.parm.capture.timeperframe.denominator;
+	}
+	
 	std::cout << "Selected camera mode: \n"
-		<< " width: " << fmt.fmt.pix.width << '\n'
-		<< " height: " << fmt.fmt.pix.height << '\n'
-		<< " format: " << fourcc << '\n'
-		<< " field: " << fmt.fmt.pix.field << std::endl;
+		<< " width: " << _captureMode.width << '\n'
+		<< " height: " << _captureMode.height << '\n'
+		<< " format: " << _captureMode.format() << '\n'
+		<< " field: " << fmt.fmt.pix.field << '\n'
+		<< " fps: " << _captureMode.fps() << std::endl;
+	
+	if ((mode.width != 0 && mode.width != _captureMode.width)
+		|| (mode.height != 0 && mode.height != _captureMode.height)
+		|| requestedFormat != _captureMode.pixelFormat
+		|| (mode.intervalNumerator != 0 && std::fabs(mode.fps() - _captureMode.fps()) > 0.01))
+	{
+		std::cout << "The driver adjusted the requested mode." << std::endl;
+	}
+}
+
+std::vector<V4L2Camera::CaptureMode> V4L2Camera::enumerateModes()
+{
+	std::vector<CaptureMode> modes;
+	
+	struct v4l2_fmtdesc fmtdesc = { 0 };
+	fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	for (; enumerate(VIDIOC_ENUM_FMT, &fmtdesc); fmtdesc.index++)
+	{
+		std::vector<CaptureMode> sizes;
+		
+		struct v4l2_frmsizeenum frmsize = { 0 };
+		frmsize.pixel_format = fmtdesc.pixelformat;
+		for (; enumerate(VIDIOC_ENUM_FRAMESIZES, &frmsize); frmsize.index++)
+		{
+			CaptureMode size;
+			size.pixelFormat = fmtdesc.pixelformat;
+			
+			if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE)
+			{
+				size.width = frmsize.discrete.width;
+				size.height = frmsize.discrete.height;
+				sizes.push_back(size);
+				continue;
+			}
+			
+			// stepwise or continuous, the only entry
+			size.width = frmsize.stepwise.min_width;
+			size.height = frmsize.stepwise.min_height;
+			sizes.push_back(size);
+			size.width = frmsize.stepwise.max_width;
+			size.height = frmsize.stepwise.max_height;
+			sizes.push_back(size);
+			break;
+		}
+		
+		for (const CaptureMode& size : sizes)
+		{
+			const std::size_t modesCount = modes.size();
+			
+			struct v4l2_frmivalenum frmival = { 0 };
+			frmival.pixel_format = size.pixelFormat;
+			frmival.width = size.width;
+			frmival.height = size.height;
+			for (; enumerate(VIDIOC_ENUM_FRAMEINTERVALS, &frmival); frmival.index++)
+			{
+				CaptureMode mode = size;
+				
+				if (frmival.type == V4L2_FRMIVAL_TYPE_DISCRETE)
+				{
+					mode.intervalNumerator = frmival.discrete.numerator;
+					mode.intervalDenominator = frmival.discrete.denominator;
+					modes.push_back(mode);
+					continue;
+				}
+				
+				// stepwise or continuous, the fastest and the slowest rates
+				mode.intervalNumerator = frmival.stepwise.min.numerator;
+				mode.intervalDenominator = frmival.stepwise.min.denominator;
+				modes.push_back(mode);
+				mode.intervalNumerator = frmival.stepwise.max.numerator;
+				mode.intervalDenominator = frmival.stepwise.max.denominator;
+				modes.push_back(mode);
+				break;
+			}
+			
+			// the frame rate is unknown
+			if (modes.size() == modesCount)
+			{
+				modes.push_back(size);
+			}
+		}
+	}
+	
+	return modes;
 }
 
-void V4L2Camera::setupCaptureBuffer()
+bool V4L2Camera::selectMode(const std::vector<CaptureMode>& modes, const CaptureMode& requested,
+							double bandwidth, CaptureMode& selected)
 {
-	/* TO DO: benchmark capturing into memory mapped buffer,
-	 * implement capturing into user buffer, benchmark also.
+	const double maxFps = requested.fps();
+	bool found = false;
+	
+	for (const CaptureMode& mode : modes)
+	{
+		if ((requested.width != 0 && mode.width != requested.width)
+			|| (requested.height != 0 && mode.height != requested.height)
+			|| (requested.pixelFormat != 0 && mode.pixelFormat != requested.pixelFormat)
+			|| (maxFps > 0 && mode.fps() > maxFps + 0.01)
+			|| (bandwidth > 0 && mode.bitrate() > bandwidth))
+		{
+			continue;
+		}
+		
+		const double fps = mode.fps();
+		const std::uint64_t area = static_cast<std::uint64_t>(mode.width) * mode.height;
+		const std::uint64_t selectedArea = static_cast<std::uint64_t>(selected.width) * selected.height;
+		if (!found || fps > selected.fps() || (fps == selected.fps() && area > selectedArea))
+		{
+			selected = mode;
+			found = true;
+		}
+	}
+	
+	return found;
+}
+
+std::uint32_t V4L2Camera::pixelFormat(const std::string& fourcc)
+{
+	if (fourcc.empty() || fourcc.size() > 4)
+	{
+		return 0;
+	}
+	
+	// the short codes are padded with spaces (e.g. "Y8  ")
+	const std::string padded = fourcc + std::string(4 - fourcc.size(), ' ');
+	return v4l2_fourcc(padded[0], padded[1], padded[2], padded[3]);
+}
+
+void V4L2Camera::setupCaptureBuffer(unsigned buffersCount/* = DEFAULT_BUFFERS_COUNT*/, 
+	IoMethod ioMethod/* = IoMethod::Mmap*/)
+{
+	/* The number of buffers and the I/O method can be chosen with
+	 * bench/v4l2-capture-bench (fps, CPU time and copies per frame).
 	 * */
+	assert(buffersCount != 0);
+	
+	if (_isStreaming)
+	{
+		throw std::logic_error("Could not setup capture buffers while capturing.");
+	}
+	
+	releaseBuffers();
+	_buffers = std::make_shared<MappedBuffers>();
+	_buffers->ioMethod = ioMethod;
+	
 	struct v4l2_requestbuffers req = { 0 };
-	req.count = 1;
+	req.count = buffersCount;
 	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	req.memory = V4L2_MEMORY_MMAP;
+	req.memory = ioMethod == IoMethod::UserPtr ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
 	
 	if (V4L2Camera::ioctl(VIDIOC_REQBUFS, &req) == -1)
 	{
-		throw std::runtime_error("Could not request capture buffer.");
+		throw std::runtime_error(ioMethod == IoMethod::UserPtr 
+			? "Could not request capture buffer, the device may not support user buffers."
+			: "Could not request capture buffer.");
 	}
 	
+	// the driver may allocate less (or more) buffers than requested
+	if (req.count == 0)
+	{
+		throw std::runtime_error("Could not allocate capture buffer.");
+	}
 	
-	struct v4l2_buffer buf = { 0 };
-	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf.memory = V4L2_MEMORY_MMAP;
-	buf.index = 0;
-	
-	if (V4L2Camera::ioctl(VIDIOC_QUERYBUF, &buf) == -1)
+	if (ioMethod == IoMethod::UserPtr)
 	{
-		throw std::runtime_error("Could not query capture buffer.");
+		// the buffers should fit the largest image of the current format
+		struct v4l2_format fmt = { 0 };
+		fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		
+		if (V4L2Camera::ioctl(VIDIOC_G_FMT, &fmt) == -1)
+		{
+			releaseBuffers();
+			throw std::runtime_error("Could not get capture format.");
+		}
+		
+		const std::size_t pageSize = sysconf(_SC_PAGESIZE);
+		_buffers->bufferLength = (fmt.fmt.pix.sizeimage + pageSize - 1) / pageSize * pageSize;
+		
+		for (unsigned i = 0; i < req.count; i++)
+		{
+			MappedBuffers::Mapping mapping;
+			mapping.start = _buffers->takeSpare();
+			mapping.length = _buffers->bufferLength;
+			
+			if (mapping.start == nullptr)
+			{
+				releaseBuffers();
+				throw std::runtime_error("Could not allocate user buffer.");
+			}
+			
+			_buffers->mappings.push_back(mapping);
+		}
 	}
-
-	void* buffer = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, 
-						MAP_SHARED, _fd, buf.m.offset);
-							
-	if (buffer == MAP_FAILED)
+	else
 	{
-		perror("mmap()");
-		throw std::runtime_error("Could not map device file to memory.");
+		for (unsigned i = 0; i < req.count; i++)
+		{
+			struct v4l2_buffer buf = { 0 };
+			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			buf.memory = V4L2_MEMORY_MMAP;
+			buf.index = i;
+			
+			if (V4L2Camera::ioctl(VIDIOC_QUERYBUF, &buf) == -1)
+			{
+				releaseBuffers();
+				throw std::runtime_error("Could not query capture buffer.");
+			}
+			
+			MappedBuffers::Mapping mapping;
+			mapping.length = buf.length;
+			
+			void* buffer = MAP_FAILED;
+			if (ioMethod == IoMethod::DmaBuf)
+			{
+				struct v4l2_exportbuffer expbuf = { 0 };
+				expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+				expbuf.index = i;
+				expbuf.flags = O_CLOEXEC | O_RDONLY;
+				
+				if (V4L2Camera::ioctl(VIDIOC_EXPBUF, &expbuf) == -1)
+				{
+					releaseBuffers();
+					throw std::runtime_error("Could not export capture buffer.");
+				}
+				
+				mapping.dmabufFd = expbuf.fd;
+				buffer = mmap(NULL, buf.length, PROT_READ, MAP_SHARED, expbuf.fd, 0);
+			}
+			else
+			{
+				buffer = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, 
+							MAP_SHARED, _fd, buf.m.offset);
+			}
+									
+			if (buffer == MAP_FAILED)
+			{
+				perror("mmap()");
+				if (mapping.dmabufFd != -1)
+				{
+					close(mapping.dmabufFd);
+				}
+				releaseBuffers();
+				throw std::runtime_error("Could not map device file to memory.");
+			}
+			
+			mapping.start = static_cast<unsigned char*>(buffer);
+			_buffers->mappings.push_back(mapping);
+		}
 	}
-	
-	_buffer = static_cast<unsigned char*>(buffer);
-	_bufferLength = buf.length;
 
 	const std::ios_base::fmtflags fmtFlags = std::cout.flags();
 	
-	std::cout << "Buffer: \n"
-		<< " address: " << std::setw(8) << std::setfill('0') << std::hex << _buffer << '\n';
-	std::cout.flags(fmtFlags);
-	std::cout << " length: " << _bufferLength << std::endl;
-	std::cout << "Image size (bytes): " << buf.bytesused << std::endl;	
+	std::cout << "Buffers (" << _buffers->mappings.size() << "): \n";
+	for (const MappedBuffers::Mapping& mapping : _buffers->mappings)
+	{
+		std::cout << " address: " << std::setw(8) << std::setfill('0') << std::hex 
+			<< static_cast<const void*>(mapping.start);
+		std::cout.flags(fmtFlags);
+		std::cout << " length: " << mapping.length;
+		if (mapping.dmabufFd != -1)
+		{
+			std::cout << " dmabuf: " << mapping.dmabufFd;
+		}
+		std::cout << '\n';
+	}
+	std::cout << std::flush;
 }
 
-void V4L2Camera::stopCapturing()
+void V4L2Camera::startCapturing()
 {
-	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (_isStreaming)
+	{
+		return;
+	}
 	
-	if (V4L2Camera::ioctl(VIDIOC_STREAMOFF, &type) == -1)
+	if (!_buffers || _buffers->mappings.empty())
 	{
-		throw std::runtime_error("Could not stop capturing.");
+		throw std::logic_error("Capture buffers are not set up.");
 	}
-}
-
-std::vector<unsigned char> V4L2Camera::captureFrame()
-{
-	struct v4l2_buffer buf = { 0 };
-	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf.memory = V4L2_MEMORY_MMAP;
-	buf.index = 0;
 	
-	if (V4L2Camera::ioctl(VIDIOC_QBUF, &buf) == -1)
+	std::lock_guard<std::mutex> lg(_buffers->mutex);
+	if (_buffers->held != 0)
 	{
-		throw std::runtime_error("Could not query buffer.");
+		throw std::logic_error("Frames captured before are still referred.");
+	}
+	
+	// give all buffers to the driver, it fills them in a ring
+	for (unsigned i = 0; i < _buffers->mappings.size(); i++)
+	{
+		queueBuffer(i);
 	}
-
 	
 	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	
@@ -206,34 +709,178 @@ std::vector<unsigned char> V4L2Camera::captureFrame()
 	{
 		throw std::runtime_error("Could not start capturing.");
 	}
-		
+	
+	_isStreaming = true;
+	_buffers->fd = _fd;
+}
+
+void V4L2Camera::stopCapturing()
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	
+	if (_buffers)
+	{
+		// the buffers referred by frames are not returned to driver anymore
+		std::lock_guard<std::mutex> lg(_buffers->mutex);
+		_buffers->fd = -1;
+	}
+	
+	if (V4L2Camera::ioctl(VIDIOC_STREAMOFF, &type) == -1)
+	{
+		throw std::runtime_error("Could not stop capturing.");
+	}
+	
+	_isStreaming = false;
+}
+
+bool V4L2Camera::dequeueBuffer(Buffer& buffer, int timeout/* = 2000*/)
+{
+	assert(_isStreaming);
+	
 	fd_set fds;
 	FD_ZERO(&fds);
 	FD_SET(_fd, &fds);
 	
 	struct timeval tv{ 0 };
-	tv.tv_sec = 2;
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
 	int r = select(_fd + 1, &fds, NULL, NULL, &tv);
-	if (r == -1)
+	if (r == -1 && errno != EINTR)
+	{
+		perror("select()");
+		throw std::runtime_error("Could not wait for frame.");
+	}
+	
+	if (r <= 0)
 	{
 		std::cout << "Capture timeout expired." << std::endl;
-		return {};
+		return false;
 	}
-		 
-	// buf.length = _bufferLength;	
-	 	 	
+	
+	struct v4l2_buffer buf = { 0 };
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = _buffers->ioMethod == IoMethod::UserPtr ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
+	
 	if (V4L2Camera::ioctl(VIDIOC_DQBUF, &buf) == -1)
 	{
 		throw std::runtime_error("Could not read frame data from buffer.");
 	}
 	
+	assert(buf.index < _buffers->mappings.size());
+	
+	const MappedBuffers::Mapping& mapping = _buffers->mappings[buf.index];
+	_buffers->syncAccess(buf.index, true);
+	
+	buffer.index = buf.index;
+	buffer.data = mapping.start;
+	buffer.size = buf.bytesused;
+	buffer.sequence = buf.sequence;
+	buffer.dmabufFd = mapping.dmabufFd;
+	
+	// the monotonic timestamp is taken by the same clock as steady_clock,
+	// the others are not comparable, the dequeue time is used instead
+	if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+	{
+		buffer.timestamp = std::chrono::steady_clock::time_point(
+			std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				std::chrono::seconds(buf.timestamp.tv_sec) 
+				+ std::chrono::microseconds(buf.timestamp.tv_usec)));
+	}
+	else
+	{
+		buffer.timestamp = std::chrono::steady_clock::now();
+	}
+	
 	// trace message
 	/*
 	std::cout << " captured " << buf.bytesused
-			<< " bytes, buffer length " << _bufferLength << " bytes "
+			<< " bytes, buffer " << buf.index << " length " 
+			<< _buffers->mappings[buf.index].length << " bytes "
 			<< std::endl; */
 	
-	return std::vector<unsigned char>(_buffer, _buffer + buf.bytesused);
+	return true;
+}
+
+void V4L2Camera::requeueBuffer(unsigned index)
+{
+	assert(index < _buffers->mappings.size());
+	
+	_buffers->syncAccess(index, false);
+	queueBuffer(index);
+}
+
+FramePtr V4L2Camera::captureFrame()
+{
+	if (!_isStreaming)
+	{
+		startCapturing();
+	}
+	
+	Buffer buffer;
+	if (!dequeueBuffer(buffer))
+	{
+		return nullptr;
+	}
+	
+	_framesCaptured += 1;
+	
+	if (_buffers->ioMethod == IoMethod::UserPtr)
+	{
+		// the filled buffer is taken by the frame, 
+		// the driver gets the spare one in its place
+		unsigned char* spare = _buffers->takeSpare();
+		if (spare != nullptr)
+		{
+			std::shared_ptr<MappedBuffers> buffers(_buffers);
+			unsigned char* start = _buffers->mappings[buffer.index].start;
+			_buffers->mappings[buffer.index].start = spare;
+			
+			std::shared_ptr<Frame> frame = std::make_shared<Frame>(buffer.data, buffer.size, 
+				[buffers, start](std::vector<unsigned char>&)
+				{
+					buffers->recycle(start);
+				});
+			frame->setCaptureInfo(buffer.timestamp, buffer.sequence);
+			
+			queueBuffer(buffer.index);
+			return frame;
+		}
+	}
+	else
+	{
+		std::lock_guard<std::mutex> lg(_buffers->mutex);
+		
+		// at least one buffer should remain queued, 
+		// otherwise the driver has nothing to fill
+		if (_buffers->held + 2 <= _buffers->mappings.size())
+		{
+			_buffers->held += 1;
+			
+			std::shared_ptr<MappedBuffers> buffers(_buffers);
+			const unsigned index = buffer.index;
+			std::shared_ptr<Frame> frame = std::make_shared<Frame>(buffer.data, buffer.size, 
+				[buffers, index](std::vector<unsigned char>&)
+				{
+					buffers->release(index);
+				});
+			frame->setCaptureInfo(buffer.timestamp, buffer.sequence);
+			return frame;
+		}
+	}
+	
+	std::shared_ptr<Frame> frame = _framePool.copyFrame(buffer.data, buffer.size);
+	frame->setCaptureInfo(buffer.timestamp, buffer.sequence);
+	_framesCopied += 1;
+	
+	// the driver fills the next buffers meanwhile
+	requeueBuffer(buffer.index);
+	
+	return frame;
+}
+
+std::size_t V4L2Camera::buffersCount() const
+{
+	return _buffers ? _buffers->mappings.size() : 0;
 }
 
 
@@ -255,3 +902,46 @@ int V4L2Camera::ioctl(int request, void* arg)
 	
 	return r;
 }
+
+bool V4L2Camera::enumerate(int request, void* arg)
+{
+	assert(_fd != -1);
+	
+	int r = -1;
+	do
+	{
+		r = ::ioctl(_fd, request, arg);
+	}
+	while (r == -1 && errno == EINTR);
+	
+	if (r == -1 && errno != EINVAL && errno != ENOTTY)
+	{
+		perror("ioctl()");
+		throw std::runtime_error("Could not enumerate capture modes.");
+	}
+	
+	return r == 0;
+}
+
+void V4L2Camera::queueBuffer(unsigned index)
+{
+	struct v4l2_buffer buf = { 0 };
+	_buffers->describe(index, buf);
+	
+	if (V4L2Camera::ioctl(VIDIOC_QBUF, &buf) == -1)
+	{
+		throw std::runtime_error("Could not queue buffer.");
+	}
+}
+
+void V4L2Camera::releaseBuffers()
+{
+	if (_buffers)
+	{
+		// the frames still referring the buffers keep them mapped
+		std::lock_guard<std::mutex> lg(_buffers->mutex);
+		_buffers->fd = -1;
+	}
+	
+	_buffers.reset();
+}
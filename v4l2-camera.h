@@ -1,31 +1,144 @@
 #pragma once
 
+#include "frame.h"
+#include "frame-source.h"
+
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
 #include <vector>
 
-class V4L2Camera final
+class V4L2Camera final : public FrameSource
 {
+public:
+	static const unsigned DEFAULT_BUFFERS_COUNT;
+	static const std::uint32_t DEFAULT_WIDTH;
+	static const std::uint32_t DEFAULT_HEIGHT;
+	
+	// the format, the frame size and rate of capturing
+	struct CaptureMode
+	{
+		std::uint32_t width = 0;
+		std::uint32_t height = 0;
+		std::uint32_t pixelFormat = 0;	// V4L2_PIX_FMT_*
+		// the frame interval in seconds (numerator / denominator), 0 - unknown
+		std::uint32_t intervalNumerator = 0;
+		std::uint32_t intervalDenominator = 0;
+		std::uint32_t bytesPerLine = 0;	// granted by the driver, 0 - unknown
+		
+		double fps() const;
+		void setFps(double fps);
+		
+		// the fourcc of the pixel format, e.g. "MJPG"
+		std::string format() const;
+		
+		// estimated bit/s, the compressed formats are assumed to take 2 bits per pixel
+		double bitrate() const;
+	};
+	
+	// how the frames get from the driver to us
+	enum class IoMethod
+	{
+		Mmap,		// the driver's buffers mapped to memory
+		UserPtr,	// the driver fills the buffers allocated by us
+		DmaBuf		// the driver's buffers exported as DMABUF and mapped
+	};
+	
+	// the buffer filled by driver, it's owned by the driver again
+	// after the buffer is returned with requeueBuffer()
+	struct Buffer
+	{
+		unsigned index = 0;
+		const unsigned char* data = nullptr;
+		std::size_t size = 0;
+		std::uint32_t sequence = 0;	// the gaps are the frames dropped by the driver
+		std::chrono::steady_clock::time_point timestamp;	// when the frame is captured
+		int dmabufFd = -1;	// the exported buffer (DmaBuf only), may be passed to other devices
+	};
+	
 public:
 	V4L2Camera(const V4L2Camera&) = delete;
 	V4L2Camera& operator=(const V4L2Camera&) = delete;
 	
 	V4L2Camera() = default;
-	~V4L2Camera();
+	~V4L2Camera() override;
 	
 	void openDevice(const char* deviceName);
 	void printCapabilities();
+	
+	// the mode fields left 0 are DEFAULT_WIDTH, DEFAULT_HEIGHT, MJPEG and
+	// the driver's frame rate. the driver may adjust the mode, the granted
+	// one is returned by captureMode().
 	void setupCaptureFormat();
-	void setupCaptureBuffer();
+	void setupCaptureFormat(const CaptureMode& mode);
+	
+	const CaptureMode& captureMode() const
+	{
+		return _captureMode;
+	}
+	
+	// the formats, frame sizes and rates supported by the device. the stepwise
+	// ranges are represented by their bounds.
+	std::vector<CaptureMode> enumerateModes();
 	
-	void stopCapturing();
+	// the fastest mode (then the largest one) matching the requested fields
+	// (0 - any, the requested fps is the upper limit) with the bitrate
+	// within the budget (bit/s, 0 - unlimited). return false if none fits.
+	static bool selectMode(const std::vector<CaptureMode>& modes, const CaptureMode& requested,
+						double bandwidth, CaptureMode& selected);
 	
-	std::vector<unsigned char> captureFrame();
+	// the V4L2_PIX_FMT_* of the fourcc (up to 4 characters), 0 if it's malformed
+	static std::uint32_t pixelFormat(const std::string& fourcc);
+	
+	void setupCaptureBuffer(unsigned buffersCount = DEFAULT_BUFFERS_COUNT, 
+		IoMethod ioMethod = IoMethod::Mmap);
+	
+	void startCapturing() override;
+	void stopCapturing() override;
+	
+	// wait for the filled buffer (timeout in milliseconds).
+	// return false if timeout expired.
+	bool dequeueBuffer(Buffer& buffer, int timeout = 2000);
+	void requeueBuffer(unsigned index);
+	
+	// the frame refers to the V4L2 buffer directly, the buffer is requeued
+	// when the frame is released. if too few buffers are left to the driver,
+	// the frame is copied to the pooled memory instead. with user buffers
+	// the driver gets a spare buffer in place of the one taken by the frame,
+	// so nothing is copied.
+	// return nullptr if timeout expired.
+	FramePtr captureFrame() override;
+	
+	std::size_t buffersCount() const;
+	
+	// the frames returned by captureFrame() and how many of them were copied
+	std::uint64_t framesCaptured() const
+	{
+		return _framesCaptured;
+	}
+	
+	std::uint64_t framesCopied() const
+	{
+		return _framesCopied;
+	}
 	
 private:
 	int ioctl(int request, void* arg);
+	// return false at the end of the list
+	bool enumerate(int request, void* arg);
+	void queueBuffer(unsigned index);
+	void releaseBuffers();
 	
 private:
+	struct MappedBuffers;
+	
 	int _fd = -1;
-	unsigned char* _buffer = NULL;
-	size_t _bufferLength = 0;
+	bool _isStreaming = false;
+	CaptureMode _captureMode;
+	std::shared_ptr<MappedBuffers> _buffers;
+	FramePool _framePool;
+	std::uint64_t _framesCaptured = 0;
+	std::uint64_t _framesCopied = 0;
 };